@@ -122,6 +122,8 @@ fail_snd:
 fail:
     if (aaudio && aaudio->dev)
         device_destroy(aaudio_class, aaudio->devt);
+    if (aaudio)
+        aaudio_bce_free(aaudio);
     kfree(aaudio);
 
     if (!IS_ERR_OR_NULL(aaudio->reg_mem_bs))
@@ -150,6 +152,7 @@ static void aaudio_remove(struct pci_dev *dev)
         list_del(&sdev->list);
         aaudio_free_dev(sdev);
     }
+    aaudio_bce_free(aaudio);
     pci_iounmap(dev, aaudio->reg_mem_bs);
     pci_iounmap(dev, aaudio->reg_mem_cfg);
     device_destroy(aaudio_class, aaudio->devt);
@@ -207,34 +210,72 @@ static int aaudio_init_cmd(struct aaudio_device *a)
     }
     dev_info(a->dev, "Continuing init\n");
 
-    buf = aaudio_reply_alloc();
+    buf = aaudio_reply_alloc(a);
     if ((status = aaudio_cmd_get_device_list(a, &buf, &dev_l, &dev_cnt))) {
         dev_err(a->dev, "Failed to get device list\n");
-        aaudio_reply_free(&buf);
+        aaudio_reply_free(a, &buf);
         return status;
     }
     for (dev_i = 0; dev_i < dev_cnt; ++dev_i)
         aaudio_init_dev(a, dev_l[dev_i]);
-    aaudio_reply_free(&buf);
+    aaudio_reply_free(a, &buf);
 
     return 0;
 }
 
-static void aaudio_init_stream_info(struct aaudio_subdevice *sdev, struct aaudio_stream *strm);
+/* The queries of a stream are sent together with the ones of the other streams, and only then waited for */
+struct aaudio_stream_info_query {
+    struct aaudio_cmd_async desc_cmd, latency_cmd;
+    struct aaudio_msg desc_buf, latency_buf;
+    int desc_status, latency_status;
+};
+
+static void aaudio_init_stream_info_send(struct aaudio_subdevice *sdev, struct aaudio_stream *strm,
+        struct aaudio_stream_info_query *q);
+static void aaudio_init_stream_info_wait(struct aaudio_subdevice *sdev, struct aaudio_stream *strm,
+        struct aaudio_stream_info_query *q);
 static void aaudio_handle_jack_connection_change(struct aaudio_subdevice *sdev);
 
 static void aaudio_init_dev(struct aaudio_device *a, aaudio_device_id_t dev_id)
 {
     struct aaudio_subdevice *sdev;
-    struct aaudio_msg buf = aaudio_reply_alloc();
-    u64 uid_len, stream_cnt, i;
-    aaudio_object_id_t *stream_list;
+    struct aaudio_msg buf = aaudio_reply_alloc(a);
+    struct aaudio_msg in_lat_buf = aaudio_reply_alloc(a), out_lat_buf = aaudio_reply_alloc(a);
+    struct aaudio_msg in_buf = aaudio_reply_alloc(a), out_buf = aaudio_reply_alloc(a);
+    struct aaudio_cmd_async uid_cmd, in_lat_cmd, out_lat_cmd, in_cmd, out_cmd;
+    struct aaudio_stream_info_query in_q[AAUDIO_DEIVCE_MAX_INPUT_STREAMS];
+    struct aaudio_stream_info_query out_q[AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS];
+    int uid_status, in_lat_status, out_lat_status, in_status, out_status;
+    u64 uid_len, in_cnt = 0, out_cnt = 0, i;
+    aaudio_object_id_t *in_list = NULL, *out_list = NULL;
     char *uid;
 
     sdev = kzalloc(sizeof(struct aaudio_subdevice), GFP_KERNEL);
 
-    if (aaudio_cmd_get_property(a, &buf, dev_id, dev_id, AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_UID, 0),
-            NULL, 0, (void **) &uid, &uid_len) || uid_len > AAUDIO_DEVICE_MAX_UID_LEN) {
+    /* None of the device queries depend on each other, so have all of them in flight at once */
+    uid_status = aaudio_cmd_get_property_async(a, &uid_cmd, &buf, dev_id, dev_id,
+            AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_UID, 0), NULL, 0);
+    in_lat_status = aaudio_cmd_get_property_async(a, &in_lat_cmd, &in_lat_buf, dev_id, dev_id,
+            AAUDIO_PROP(AAUDIO_PROP_SCOPE_INPUT, AAUDIO_PROP_LATENCY, 0), NULL, 0);
+    out_lat_status = aaudio_cmd_get_property_async(a, &out_lat_cmd, &out_lat_buf, dev_id, dev_id,
+            AAUDIO_PROP(AAUDIO_PROP_SCOPE_OUTPUT, AAUDIO_PROP_LATENCY, 0), NULL, 0);
+    in_status = aaudio_cmd_get_input_stream_list_async(a, &in_cmd, &in_buf, dev_id);
+    out_status = aaudio_cmd_get_output_stream_list_async(a, &out_cmd, &out_buf, dev_id);
+
+    if (!uid_status)
+        uid_status = aaudio_cmd_get_property_wait(a, &uid_cmd, &buf, (void **) &uid, &uid_len);
+    if (!in_lat_status)
+        in_lat_status = aaudio_cmd_get_primitive_property_wait(a, &in_lat_cmd, &in_lat_buf,
+                &sdev->in_latency, sizeof(u32));
+    if (!out_lat_status)
+        out_lat_status = aaudio_cmd_get_primitive_property_wait(a, &out_lat_cmd, &out_lat_buf,
+                &sdev->out_latency, sizeof(u32));
+    if (!in_status)
+        in_status = aaudio_cmd_get_input_stream_list_wait(a, &in_cmd, &in_buf, &in_list, &in_cnt);
+    if (!out_status)
+        out_status = aaudio_cmd_get_output_stream_list_wait(a, &out_cmd, &out_buf, &out_list, &out_cnt);
+
+    if (uid_status || uid_len > AAUDIO_DEVICE_MAX_UID_LEN) {
         dev_err(a->dev, "Failed to get device uid for device %llx\n", dev_id);
         goto fail;
     }
@@ -247,45 +288,49 @@ static void aaudio_init_dev(struct aaudio_device *a, aaudio_device_id_t dev_id)
     strncpy(sdev->uid, uid, uid_len);
     sdev->uid[uid_len + 1] = '\0';
 
-    if (aaudio_cmd_get_primitive_property(a, dev_id, dev_id,
-            AAUDIO_PROP(AAUDIO_PROP_SCOPE_INPUT, AAUDIO_PROP_LATENCY, 0), NULL, 0, &sdev->in_latency, sizeof(u32)))
+    if (in_lat_status)
         dev_warn(a->dev, "Failed to query device input latency\n");
-    if (aaudio_cmd_get_primitive_property(a, dev_id, dev_id,
-            AAUDIO_PROP(AAUDIO_PROP_SCOPE_OUTPUT, AAUDIO_PROP_LATENCY, 0), NULL, 0, &sdev->out_latency, sizeof(u32)))
+    if (out_lat_status)
         dev_warn(a->dev, "Failed to query device output latency\n");
 
-    if (aaudio_cmd_get_input_stream_list(a, &buf, dev_id, &stream_list, &stream_cnt)) {
+    if (in_status) {
         dev_err(a->dev, "Failed to get input stream list for device %llx\n", dev_id);
         goto fail;
     }
-    if (stream_cnt > AAUDIO_DEIVCE_MAX_INPUT_STREAMS) {
+    if (in_cnt > AAUDIO_DEIVCE_MAX_INPUT_STREAMS) {
         dev_warn(a->dev, "Device %s input stream count %llu is larger than the supported count of %u\n",
-                sdev->uid, stream_cnt, AAUDIO_DEIVCE_MAX_INPUT_STREAMS);
-        stream_cnt = AAUDIO_DEIVCE_MAX_INPUT_STREAMS;
-    }
-    sdev->in_stream_cnt = stream_cnt;
-    for (i = 0; i < stream_cnt; i++) {
-        sdev->in_streams[i].id = stream_list[i];
-        sdev->in_streams[i].buffer_cnt = 0;
-        aaudio_init_stream_info(sdev, &sdev->in_streams[i]);
-        sdev->in_streams[i].latency += sdev->in_latency;
+                sdev->uid, in_cnt, AAUDIO_DEIVCE_MAX_INPUT_STREAMS);
+        in_cnt = AAUDIO_DEIVCE_MAX_INPUT_STREAMS;
     }
-
-    if (aaudio_cmd_get_output_stream_list(a, &buf, dev_id, &stream_list, &stream_cnt)) {
+    if (out_status) {
         dev_err(a->dev, "Failed to get output stream list for device %llx\n", dev_id);
         goto fail;
     }
-    if (stream_cnt > AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS) {
-        dev_warn(a->dev, "Device %s input stream count %llu is larger than the supported count of %u\n",
-                 sdev->uid, stream_cnt, AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS);
-        stream_cnt = AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS;
+    if (out_cnt > AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS) {
+        dev_warn(a->dev, "Device %s output stream count %llu is larger than the supported count of %u\n",
+                 sdev->uid, out_cnt, AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS);
+        out_cnt = AAUDIO_DEIVCE_MAX_OUTPUT_STREAMS;
+    }
+
+    sdev->in_stream_cnt = in_cnt;
+    for (i = 0; i < in_cnt; i++) {
+        sdev->in_streams[i].id = in_list[i];
+        sdev->in_streams[i].buffer_cnt = 0;
+        aaudio_init_stream_info_send(sdev, &sdev->in_streams[i], &in_q[i]);
     }
-    sdev->out_stream_cnt = stream_cnt;
-    for (i = 0; i < stream_cnt; i++) {
-        sdev->out_streams[i].id = stream_list[i];
+    sdev->out_stream_cnt = out_cnt;
+    for (i = 0; i < out_cnt; i++) {
+        sdev->out_streams[i].id = out_list[i];
         sdev->out_streams[i].buffer_cnt = 0;
-        aaudio_init_stream_info(sdev, &sdev->out_streams[i]);
-        sdev->out_streams[i].latency += sdev->in_latency;
+        aaudio_init_stream_info_send(sdev, &sdev->out_streams[i], &out_q[i]);
+    }
+    for (i = 0; i < in_cnt; i++) {
+        aaudio_init_stream_info_wait(sdev, &sdev->in_streams[i], &in_q[i]);
+        sdev->in_streams[i].latency += sdev->in_latency;
+    }
+    for (i = 0; i < out_cnt; i++) {
+        aaudio_init_stream_info_wait(sdev, &sdev->out_streams[i], &out_q[i]);
+        sdev->out_streams[i].latency += sdev->out_latency;
     }
 
     if (sdev->is_pcm)
@@ -299,24 +344,44 @@ static void aaudio_init_dev(struct aaudio_device *a, aaudio_device_id_t dev_id)
         aaudio_handle_jack_connection_change(sdev);
     }
 
-    aaudio_reply_free(&buf);
-
     list_add_tail(&sdev->list, &a->subdevice_list);
-    return;
+    goto done;
 
 fail:
-    aaudio_reply_free(&buf);
     kfree(sdev);
+done:
+    aaudio_reply_free(a, &buf);
+    aaudio_reply_free(a, &in_lat_buf);
+    aaudio_reply_free(a, &out_lat_buf);
+    aaudio_reply_free(a, &in_buf);
+    aaudio_reply_free(a, &out_buf);
+}
+
+static void aaudio_init_stream_info_send(struct aaudio_subdevice *sdev, struct aaudio_stream *strm,
+        struct aaudio_stream_info_query *q)
+{
+    q->desc_buf = aaudio_reply_alloc(sdev->a);
+    q->latency_buf = aaudio_reply_alloc(sdev->a);
+    q->desc_status = aaudio_cmd_get_property_async(sdev->a, &q->desc_cmd, &q->desc_buf, sdev->dev_id, strm->id,
+            AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_PHYS_FORMAT, 0), NULL, 0);
+    q->latency_status = aaudio_cmd_get_property_async(sdev->a, &q->latency_cmd, &q->latency_buf, sdev->dev_id,
+            strm->id, AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_LATENCY, 0), NULL, 0);
 }
 
-static void aaudio_init_stream_info(struct aaudio_subdevice *sdev, struct aaudio_stream *strm)
+static void aaudio_init_stream_info_wait(struct aaudio_subdevice *sdev, struct aaudio_stream *strm,
+        struct aaudio_stream_info_query *q)
 {
-    if (aaudio_cmd_get_primitive_property(sdev->a, sdev->dev_id, strm->id,
-            AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_PHYS_FORMAT, 0), NULL, 0,
-            &strm->desc, sizeof(strm->desc)))
+    if (!q->desc_status)
+        q->desc_status = aaudio_cmd_get_primitive_property_wait(sdev->a, &q->desc_cmd, &q->desc_buf,
+                &strm->desc, sizeof(strm->desc));
+    if (!q->latency_status)
+        q->latency_status = aaudio_cmd_get_primitive_property_wait(sdev->a, &q->latency_cmd, &q->latency_buf,
+                &strm->latency, sizeof(u32));
+    aaudio_reply_free(sdev->a, &q->desc_buf);
+    aaudio_reply_free(sdev->a, &q->latency_buf);
+    if (q->desc_status)
         dev_warn(sdev->a->dev, "Failed to query stream descriptor\n");
-    if (aaudio_cmd_get_primitive_property(sdev->a, sdev->dev_id, strm->id,
-            AAUDIO_PROP(AAUDIO_PROP_SCOPE_GLOBAL, AAUDIO_PROP_LATENCY, 0), NULL, 0, &strm->latency, sizeof(u32)))
+    if (q->latency_status)
         dev_warn(sdev->a->dev, "Failed to query stream latency\n");
     if (strm->desc.format_id == AAUDIO_FORMAT_LPCM)
         sdev->is_pcm = true;
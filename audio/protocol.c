@@ -248,14 +248,19 @@ void aaudio_msg_write_get_device_list(struct aaudio_msg *msg)
     struct aaudio_send_ctx sctx;
 #define CMD_SHARED_VARS \
     CMD_SHARED_VARS_NO_REPLY \
-    struct aaudio_msg reply = aaudio_reply_alloc(); \
+    struct aaudio_msg reply = aaudio_reply_alloc(a); \
     struct aaudio_msg *buf = &reply;
 #define CMD_SEND_REQUEST(fn, ...) \
     if ((status = aaudio_send_cmd_sync(a, &sctx, buf, 500, fn, ##__VA_ARGS__))) \
         return status;
+#define CMD_SEND_REQUEST_OR_FREE(fn, ...) \
+    if ((status = aaudio_send_cmd_sync(a, &sctx, buf, 500, fn, ##__VA_ARGS__))) { \
+        aaudio_reply_free(a, &reply); \
+        return status; \
+    }
 #define CMD_DEF_SHARED_AND_SEND(fn, ...) \
     CMD_SHARED_VARS \
-    CMD_SEND_REQUEST(fn, ##__VA_ARGS__);
+    CMD_SEND_REQUEST_OR_FREE(fn, ##__VA_ARGS__);
 #define CMD_DEF_SHARED_NO_REPLY_AND_SEND(fn, ...) \
     CMD_SHARED_VARS_NO_REPLY \
     CMD_SEND_REQUEST(fn, ##__VA_ARGS__);
@@ -264,7 +269,7 @@ void aaudio_msg_write_get_device_list(struct aaudio_msg *msg)
     return status;
 #define CMD_HNDL_REPLY_AND_FREE(fn, ...) \
     status = fn(buf, ##__VA_ARGS__); \
-    aaudio_reply_free(&reply); \
+    aaudio_reply_free(a, &reply); \
     return status;
 
 int aaudio_cmd_start_io(struct aaudio_device *a, aaudio_device_id_t devid)
@@ -289,7 +294,7 @@ int aaudio_cmd_get_primitive_property(struct aaudio_device *a,
         struct aaudio_prop_addr prop, void *qualifier, u64 qualifier_size, void *data, u64 data_size)
 {
     int status;
-    struct aaudio_msg reply = aaudio_reply_alloc();
+    struct aaudio_msg reply = aaudio_reply_alloc(a);
     void *r_data;
     u64 r_data_size;
     if ((status = aaudio_cmd_get_property(a, &reply, devid, obj, prop, qualifier, qualifier_size,
@@ -301,7 +306,7 @@ int aaudio_cmd_get_primitive_property(struct aaudio_device *a,
     }
     memcpy(data, r_data, data_size);
 finish:
-    aaudio_reply_free(&reply);
+    aaudio_reply_free(a, &reply);
     return status;
 }
 int aaudio_cmd_set_property(struct aaudio_device *a, aaudio_device_id_t devid, aaudio_object_id_t obj,
@@ -344,4 +349,60 @@ int aaudio_cmd_get_device_list(struct aaudio_device *a, struct aaudio_msg *buf,
 {
     CMD_DEF_SHARED_NO_REPLY_AND_SEND(aaudio_msg_write_get_device_list);
     CMD_HNDL_REPLY_NO_FREE(aaudio_msg_read_get_device_list_response, dev_l, dev_cnt);
-}
\ No newline at end of file
+}
+
+#define CMD_SEND_ASYNC(fn, ...) \
+    struct aaudio_send_ctx sctx; \
+    return aaudio_send_cmd_async(a, &sctx, cmd, buf, 500, fn, ##__VA_ARGS__);
+#define CMD_WAIT_AND_HNDL_REPLY(fn, ...) \
+    int status; \
+    if ((status = aaudio_cmd_wait(a, cmd))) \
+        return status; \
+    return fn(buf, ##__VA_ARGS__);
+
+int aaudio_cmd_get_property_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd, struct aaudio_msg *buf,
+        aaudio_device_id_t devid, aaudio_object_id_t obj,
+        struct aaudio_prop_addr prop, void *qualifier, u64 qualifier_size)
+{
+    CMD_SEND_ASYNC(aaudio_msg_write_get_property, devid, obj, prop, qualifier, qualifier_size);
+}
+int aaudio_cmd_get_property_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd, struct aaudio_msg *buf,
+        void **data, u64 *data_size)
+{
+    aaudio_object_id_t obj;
+    struct aaudio_prop_addr prop;
+    CMD_WAIT_AND_HNDL_REPLY(aaudio_msg_read_get_property_response, &obj, &prop, data, data_size);
+}
+int aaudio_cmd_get_primitive_property_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, void *data, u64 data_size)
+{
+    int status;
+    void *r_data;
+    u64 r_data_size;
+    if ((status = aaudio_cmd_get_property_wait(a, cmd, buf, &r_data, &r_data_size)))
+        return status;
+    if (r_data_size != data_size)
+        return -EINVAL;
+    memcpy(data, r_data, data_size);
+    return 0;
+}
+int aaudio_cmd_get_input_stream_list_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_device_id_t devid)
+{
+    CMD_SEND_ASYNC(aaudio_msg_write_get_input_stream_list, devid);
+}
+int aaudio_cmd_get_input_stream_list_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_object_id_t **str_l, u64 *str_cnt)
+{
+    CMD_WAIT_AND_HNDL_REPLY(aaudio_msg_read_get_input_stream_list_response, str_l, str_cnt);
+}
+int aaudio_cmd_get_output_stream_list_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_device_id_t devid)
+{
+    CMD_SEND_ASYNC(aaudio_msg_write_get_output_stream_list, devid);
+}
+int aaudio_cmd_get_output_stream_list_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_object_id_t **str_l, u64 *str_cnt)
+{
+    CMD_WAIT_AND_HNDL_REPLY(aaudio_msg_read_get_output_stream_list_response, str_l, str_cnt);
+}
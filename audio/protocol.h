@@ -142,6 +142,24 @@ int aaudio_cmd_set_remote_access(struct aaudio_device *a, u64 mode);
 int aaudio_cmd_get_device_list(struct aaudio_device *a, struct aaudio_msg *buf,
         aaudio_device_id_t **dev_l, u64 *dev_cnt);
 
+/* Asynchronous variants; every *_async call that succeeded must be followed by the matching *_wait */
+struct aaudio_cmd_async;
+int aaudio_cmd_get_property_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd, struct aaudio_msg *buf,
+        aaudio_device_id_t devid, aaudio_object_id_t obj,
+        struct aaudio_prop_addr prop, void *qualifier, u64 qualifier_size);
+int aaudio_cmd_get_property_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd, struct aaudio_msg *buf,
+        void **data, u64 *data_size);
+int aaudio_cmd_get_primitive_property_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, void *data, u64 data_size);
+int aaudio_cmd_get_input_stream_list_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_device_id_t devid);
+int aaudio_cmd_get_input_stream_list_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_object_id_t **str_l, u64 *str_cnt);
+int aaudio_cmd_get_output_stream_list_async(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_device_id_t devid);
+int aaudio_cmd_get_output_stream_list_wait(struct aaudio_device *a, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *buf, aaudio_object_id_t **str_l, u64 *str_cnt);
+
 
 
 #endif //AAUDIO_PROTOCOL_H
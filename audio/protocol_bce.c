@@ -10,12 +10,19 @@ void aaudio_bce_in_queue_submit_pending(struct aaudio_bce_queue *q, size_t count
 
 int aaudio_bce_init(struct aaudio_device *dev)
 {
-    int status;
+    int status, i;
     struct aaudio_bce *bce = &dev->bcem;
-    bce->cq = bce_create_cq(dev->bce, 0x80);
+    bce->cq = bce_create_cq(dev->bce, AAUDIO_BCE_CQ_ELEMENT_COUNT);
     spin_lock_init(&bce->spinlock);
+    spin_lock_init(&bce->reply_pool_lock);
     if (!bce->cq)
         return -EINVAL;
+    /* Freed by aaudio_bce_free, also when initialization fails */
+    for (i = 0; i < AAUDIO_BCE_REPLY_POOL_COUNT; i++) {
+        bce->reply_pool[i] = kmalloc(AAUDIO_BCE_QUEUE_ELEMENT_SIZE, GFP_KERNEL);
+        if (!bce->reply_pool[i])
+            return -ENOMEM;
+    }
     if ((status = aaudio_bce_queue_init(dev, &bce->qout, "com.apple.BridgeAudio.IntelToARM", DMA_TO_DEVICE,
             aaudio_bce_out_queue_completion))) {
         return status;
@@ -28,13 +35,22 @@ int aaudio_bce_init(struct aaudio_device *dev)
     return 0;
 }
 
+void aaudio_bce_free(struct aaudio_device *dev)
+{
+    struct aaudio_bce *bce = &dev->bcem;
+    int i;
+    for (i = 0; i < AAUDIO_BCE_REPLY_POOL_COUNT; i++) {
+        kfree(bce->reply_pool[i]);
+        bce->reply_pool[i] = NULL;
+    }
+}
+
 int aaudio_bce_queue_init(struct aaudio_device *dev, struct aaudio_bce_queue *q, const char *name, int direction,
         bce_sq_completion cfn)
 {
     q->cq = dev->bcem.cq;
     q->el_size = AAUDIO_BCE_QUEUE_ELEMENT_SIZE;
     q->el_count = AAUDIO_BCE_QUEUE_ELEMENT_COUNT;
-    /* NOTE: The Apple impl uses 0x80 as the queue size, however we use 21 (in fact 20) to simplify the impl */
     q->sq = bce_create_sq(dev->bce, q->cq, name, (u32) (q->el_count + 1), direction, cfn, dev);
     if (!q->sq)
         return -EINVAL;
@@ -47,13 +63,31 @@ int aaudio_bce_queue_init(struct aaudio_device *dev, struct aaudio_bce_queue *q,
     return 0;
 }
 
-static void aaudio_send_create_tag(struct aaudio_bce *b, int *tagn, char tag[4])
+/* Tags stay printable like the original "S%03d" ones: the index and the generation are written as three
+ * characters from '0' to 'o', 6 bits each */
+static void aaudio_send_write_tag(char tag[4], u8 index, u16 generation)
 {
-    char tag_zero[5];
-    b->tag_num = (b->tag_num + 1) % AAUDIO_BCE_QUEUE_TAG_COUNT;
-    *tagn = b->tag_num;
-    snprintf(tag_zero, 5, "S%03d", b->tag_num);
-    *((u32 *) tag) = *((u32 *) tag_zero);
+    u32 v = (u32) index << AAUDIO_BCE_QUEUE_TAG_GENERATION_BITS | (generation & AAUDIO_BCE_QUEUE_TAG_GENERATION_MASK);
+    tag[0] = 'S';
+    tag[1] = (char) ('0' + ((v >> 12) & 0x3f));
+    tag[2] = (char) ('0' + ((v >> 6) & 0x3f));
+    tag[3] = (char) ('0' + (v & 0x3f));
+}
+
+static int aaudio_parse_tag(const u8 *tag, int *index, u16 *generation)
+{
+    u32 v = 0;
+    int i;
+    if (tag[0] != 'S')
+        return -EINVAL;
+    for (i = 1; i < 4; i++) {
+        if (tag[i] < '0' || tag[i] > '0' + 0x3f)
+            return -EINVAL;
+        v = v << 6 | (tag[i] - '0');
+    }
+    *index = (int) (v >> AAUDIO_BCE_QUEUE_TAG_GENERATION_BITS);
+    *generation = (u16) (v & AAUDIO_BCE_QUEUE_TAG_GENERATION_MASK);
+    return 0;
 }
 
 int __aaudio_send_prepare(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, char *tag)
@@ -69,10 +103,12 @@ int __aaudio_send_prepare(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, cha
     dptr = (u8 *) b->qout.data + index * b->qout.el_size;
     ctx->msg.data = dptr;
     header = dptr;
+    /* Commands get their tag assigned in __aaudio_send_cmd_async, nothing else expects a reply */
     if (tag)
         *((u32 *) header->tag) = *((u32 *) tag);
     else
-        aaudio_send_create_tag(b, &ctx->tag_n, header->tag);
+        aaudio_send_write_tag(header->tag, AAUDIO_BCE_QUEUE_TAG_NONE, 0);
+    ctx->tag_n = -1;
     return 0;
 }
 
@@ -89,58 +125,88 @@ void __aaudio_send(struct aaudio_bce *b, struct aaudio_send_ctx *ctx)
     spin_unlock_irqrestore(&b->spinlock, ctx->irq_flags);
 }
 
-int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_msg *reply)
+int __aaudio_send_cmd_async(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *reply)
 {
-    struct aaudio_bce_queue_entry ent;
-    DECLARE_COMPLETION_ONSTACK(cmpl);
-    ent.msg = reply;
-    ent.cmpl = &cmpl;
-    b->pending_entries[ctx->tag_n] = &ent;
+    ctx->tag_n = find_first_zero_bit(b->tags_in_use, AAUDIO_BCE_QUEUE_TAG_COUNT);
+    if (ctx->tag_n >= AAUDIO_BCE_QUEUE_TAG_COUNT) {
+        bce_cancel_submission_reservation(b->qout.sq);
+        spin_unlock_irqrestore(&b->spinlock, ctx->irq_flags);
+        pr_err("aaudio: Too many commands waiting for a reply\n");
+        return -EBUSY;
+    }
+    __set_bit(ctx->tag_n, b->tags_in_use);
+    /* Every slot counts its own generations, so a stale reply only matches after the slot was reused 1024 times */
+    b->pending_generations[ctx->tag_n] = (b->pending_generations[ctx->tag_n] + 1) &
+            AAUDIO_BCE_QUEUE_TAG_GENERATION_MASK;
+    aaudio_send_write_tag(((struct aaudio_msg_header *) ctx->msg.data)->tag, (u8) ctx->tag_n,
+            b->pending_generations[ctx->tag_n]);
+
+    init_completion(&cmd->cmpl);
+    cmd->ent.msg = reply;
+    cmd->ent.cmpl = &cmd->cmpl;
+    cmd->tag_n = ctx->tag_n;
+    cmd->timeout = ctx->timeout;
+    b->pending_entries[ctx->tag_n] = &cmd->ent;
     __aaudio_send(b, ctx); /* unlocks the spinlock */
-    ctx->timeout = wait_for_completion_timeout(&cmpl, ctx->timeout);
-    if (ctx->timeout == 0) {
+    return 0;
+}
+
+int __aaudio_cmd_wait(struct aaudio_bce *b, struct aaudio_cmd_async *cmd)
+{
+    unsigned long irq_flags;
+    bool timed_out = false;
+    if (wait_for_completion_timeout(&cmd->cmpl, cmd->timeout) == 0) {
         /* Remove the pending queue entry; this will be normally handled by the completion route but
          * during a timeout it won't */
-        spin_lock_irqsave(&b->spinlock, ctx->irq_flags);
-        if (b->pending_entries[ctx->tag_n] == &ent)
-            b->pending_entries[ctx->tag_n] = NULL;
-        spin_unlock_irqrestore(&b->spinlock, ctx->irq_flags);
-        return -ETIMEDOUT;
+        spin_lock_irqsave(&b->spinlock, irq_flags);
+        if (b->pending_entries[cmd->tag_n] == &cmd->ent) {
+            b->pending_entries[cmd->tag_n] = NULL;
+            __clear_bit(cmd->tag_n, b->tags_in_use);
+            timed_out = true;
+        }
+        spin_unlock_irqrestore(&b->spinlock, irq_flags);
     }
-    return 0;
+    return timed_out ? -ETIMEDOUT : 0;
+}
+
+int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_msg *reply)
+{
+    struct aaudio_cmd_async cmd;
+    int status;
+    if ((status = __aaudio_send_cmd_async(b, ctx, &cmd, reply)))
+        return status;
+    return __aaudio_cmd_wait(b, &cmd);
 }
 
 static void aaudio_handle_reply(struct aaudio_bce *b, struct aaudio_msg *reply)
 {
-    const char *tag;
+    const u8 *tag;
     int tagn;
+    u16 generation;
     unsigned long irq_flags;
-    char tag_zero[5];
     struct aaudio_bce_queue_entry *entry;
 
-    tag = ((struct aaudio_msg_header *) reply->data)->tag;
-    if (tag[0] != 'S') {
-        pr_err("aaudio_handle_reply: Unexpected tag: %.4s\n", tag);
-        return;
-    }
-    *((u32 *) tag_zero) = *((u32 *) tag);
-    tag_zero[4] = 0;
-    if (kstrtoint(&tag_zero[1], 10, &tagn)) {
-        pr_err("aaudio_handle_reply: Tag parse failed: %.4s\n", tag);
+    tag = (const u8 *) ((struct aaudio_msg_header *) reply->data)->tag;
+    if (aaudio_parse_tag(tag, &tagn, &generation)) {
+        pr_err("aaudio_handle_reply: Unexpected tag: %.4s\n", (const char *) tag);
         return;
     }
 
     spin_lock_irqsave(&b->spinlock, irq_flags);
-    entry = b->pending_entries[tagn];
-    if (entry) {
+    if (tagn < AAUDIO_BCE_QUEUE_TAG_COUNT && test_bit(tagn, b->tags_in_use) &&
+        b->pending_generations[tagn] == generation) {
+        entry = b->pending_entries[tagn];
         if (reply->size < entry->msg->size)
             entry->msg->size = reply->size;
         memcpy(entry->msg->data, reply->data, entry->msg->size);
         complete(entry->cmpl);
 
         b->pending_entries[tagn] = NULL;
+        __clear_bit(tagn, b->tags_in_use);
     } else {
-        pr_err("aaudio_handle_reply: No queued item found for tag: %.4s\n", tag);
+        /* Most likely the reply to a command which already timed out */
+        pr_err("aaudio_handle_reply: No queued item found for tag: %.4s\n", (const char *) tag);
     }
     spin_unlock_irqrestore(&b->spinlock, irq_flags);
 }
@@ -212,15 +278,43 @@ void aaudio_bce_in_queue_submit_pending(struct aaudio_bce_queue *q, size_t count
     bce_submit_to_device(q->sq);
 }
 
-struct aaudio_msg aaudio_reply_alloc(void)
+struct aaudio_msg aaudio_reply_alloc(struct aaudio_device *a)
 {
+    struct aaudio_bce *b = &a->bcem;
     struct aaudio_msg ret;
+    unsigned long irq_flags;
+    size_t index;
     ret.size = AAUDIO_BCE_QUEUE_ELEMENT_SIZE;
-    ret.data = kmalloc(ret.size, GFP_KERNEL);
+    spin_lock_irqsave(&b->reply_pool_lock, irq_flags);
+    index = find_first_zero_bit(b->reply_pool_in_use, AAUDIO_BCE_REPLY_POOL_COUNT);
+    if (index < AAUDIO_BCE_REPLY_POOL_COUNT)
+        __set_bit(index, b->reply_pool_in_use);
+    spin_unlock_irqrestore(&b->reply_pool_lock, irq_flags);
+    if (index < AAUDIO_BCE_REPLY_POOL_COUNT)
+        ret.data = b->reply_pool[index];
+    else
+        ret.data = kmalloc(ret.size, GFP_KERNEL);
+    if (!ret.data)
+        ret.size = 0;
     return ret;
 }
 
-void aaudio_reply_free(struct aaudio_msg *reply)
+void aaudio_reply_free(struct aaudio_device *a, struct aaudio_msg *reply)
 {
-    kfree(reply->data);
+    struct aaudio_bce *b = &a->bcem;
+    unsigned long irq_flags;
+    size_t index;
+    if (!reply->data)
+        return;
+    for (index = 0; index < AAUDIO_BCE_REPLY_POOL_COUNT; index++) {
+        if (reply->data == b->reply_pool[index])
+            break;
+    }
+    if (index == AAUDIO_BCE_REPLY_POOL_COUNT) {
+        kfree(reply->data);
+        return;
+    }
+    spin_lock_irqsave(&b->reply_pool_lock, irq_flags);
+    __clear_bit(index, b->reply_pool_in_use);
+    spin_unlock_irqrestore(&b->reply_pool_lock, irq_flags);
 }
@@ -1,13 +1,27 @@
 #ifndef AAUDIO_PROTOCOL_BCE_H
 #define AAUDIO_PROTOCOL_BCE_H
 
+#include <linux/bitmap.h>
+#include <linux/completion.h>
 #include "protocol.h"
 #include "../queue.h"
 
 #define AAUDIO_BCE_QUEUE_ELEMENT_SIZE 0x1000
-#define AAUDIO_BCE_QUEUE_ELEMENT_COUNT 20
+/* The SQs have one more entry, for a total of 0x80 like the Apple impl */
+#define AAUDIO_BCE_QUEUE_ELEMENT_COUNT 0x7f
+/* Shared by the command and the reply queue */
+#define AAUDIO_BCE_CQ_ELEMENT_COUNT 0x100
 
-#define AAUDIO_BCE_QUEUE_TAG_COUNT 1000
+/* Commands waiting for a reply; the tag carries the index into pending_entries and the generation of that slot,
+ * so replies to commands which already timed out can be told apart from the ones to the command now in the slot */
+#define AAUDIO_BCE_QUEUE_TAG_COUNT 128
+#define AAUDIO_BCE_QUEUE_TAG_NONE 0xff
+/* The three tag characters after the 'S' hold 6 bits each: 8 for the index and the rest for the generation */
+#define AAUDIO_BCE_QUEUE_TAG_GENERATION_BITS 10
+#define AAUDIO_BCE_QUEUE_TAG_GENERATION_MASK ((1u << AAUDIO_BCE_QUEUE_TAG_GENERATION_BITS) - 1)
+
+/* Reply buffers preallocated per device, enough for all the queries aaudio_init_dev has in flight */
+#define AAUDIO_BCE_REPLY_POOL_COUNT 16
 
 struct aaudio_device;
 
@@ -27,9 +41,13 @@ struct aaudio_bce {
     struct bce_queue_cq *cq;
     struct aaudio_bce_queue qin;
     struct aaudio_bce_queue qout;
-    int tag_num;
+    DECLARE_BITMAP(tags_in_use, AAUDIO_BCE_QUEUE_TAG_COUNT);
+    u16 pending_generations[AAUDIO_BCE_QUEUE_TAG_COUNT];
     struct aaudio_bce_queue_entry *pending_entries[AAUDIO_BCE_QUEUE_TAG_COUNT];
     struct spinlock spinlock;
+    void *reply_pool[AAUDIO_BCE_REPLY_POOL_COUNT];
+    DECLARE_BITMAP(reply_pool_in_use, AAUDIO_BCE_REPLY_POOL_COUNT);
+    struct spinlock reply_pool_lock;
 };
 
 struct aaudio_send_ctx {
@@ -40,10 +58,22 @@ struct aaudio_send_ctx {
     unsigned long timeout;
 };
 
+/* A command whose reply is waited for separately, so that several of them can be in flight at once */
+struct aaudio_cmd_async {
+    struct aaudio_bce_queue_entry ent;
+    struct completion cmpl;
+    int tag_n;
+    unsigned long timeout;
+};
+
 int aaudio_bce_init(struct aaudio_device *dev);
+void aaudio_bce_free(struct aaudio_device *dev);
 int __aaudio_send_prepare(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, char *tag);
 void __aaudio_send(struct aaudio_bce *b, struct aaudio_send_ctx *ctx);
 int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_msg *reply);
+int __aaudio_send_cmd_async(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, struct aaudio_cmd_async *cmd,
+        struct aaudio_msg *reply);
+int __aaudio_cmd_wait(struct aaudio_bce *b, struct aaudio_cmd_async *cmd);
 
 #define aaudio_send_with_tag(a, ctx, tag, tout, fn, ...) ({ \
     (ctx)->timeout = msecs_to_jiffies(tout); \
@@ -56,9 +86,10 @@ int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, st
 })
 #define aaudio_send(a, ctx, tout, fn, ...) aaudio_send_with_tag(a, ctx, NULL, tout, fn, ##__VA_ARGS__)
 
+/* A reply buffer without data is one aaudio_reply_alloc failed to allocate */
 #define aaudio_send_cmd_sync(a, ctx, reply, tout, fn, ...) ({ \
     (ctx)->timeout = msecs_to_jiffies(tout); \
-    (ctx)->status = __aaudio_send_prepare(&(a)->bcem, (ctx), NULL); \
+    (ctx)->status = (reply)->data ? __aaudio_send_prepare(&(a)->bcem, (ctx), NULL) : -ENOMEM; \
     if (!(ctx)->status) { \
         fn(&(ctx)->msg, ##__VA_ARGS__); \
         (ctx)->status = __aaudio_send_cmd_sync(&(a)->bcem, (ctx), (reply)); \
@@ -66,7 +97,21 @@ int __aaudio_send_cmd_sync(struct aaudio_bce *b, struct aaudio_send_ctx *ctx, st
     (ctx)->status; \
 })
 
-struct aaudio_msg aaudio_reply_alloc(void);
-void aaudio_reply_free(struct aaudio_msg *reply);
+/* The reply buffer must stay valid until aaudio_cmd_wait returns, which must be called for every sent command */
+#define aaudio_send_cmd_async(a, ctx, cmd, reply, tout, fn, ...) ({ \
+    (ctx)->timeout = msecs_to_jiffies(tout); \
+    (ctx)->status = (reply)->data ? __aaudio_send_prepare(&(a)->bcem, (ctx), NULL) : -ENOMEM; \
+    if (!(ctx)->status) { \
+        fn(&(ctx)->msg, ##__VA_ARGS__); \
+        (ctx)->status = __aaudio_send_cmd_async(&(a)->bcem, (ctx), (cmd), (reply)); \
+    } \
+    (ctx)->status; \
+})
+#define aaudio_cmd_wait(a, cmd) __aaudio_cmd_wait(&(a)->bcem, (cmd))
+
+/* Takes a buffer from the reply pool, falling back to kmalloc when all of them are in use. If that fails too, the
+ * returned message has no data and a size of 0; the aaudio_send_cmd_* macros then fail with -ENOMEM. */
+struct aaudio_msg aaudio_reply_alloc(struct aaudio_device *a);
+void aaudio_reply_free(struct aaudio_device *a, struct aaudio_msg *reply);
 
 #endif //AAUDIO_PROTOCOL_BCE_H
@@ -8,8 +8,17 @@
 #define BCE_VHCI_CMD_TIMEOUT_SHORT msecs_to_jiffies(2000)
 #define BCE_VHCI_CMD_TIMEOUT_LONG msecs_to_jiffies(30000)
 
+#define BCE_VHCI_FRAME_NUMBER_MASK 0x7ff
+
 #define BCE_VHCI_BULK_MAX_ACTIVE_URBS_POW2 2
 #define BCE_VHCI_BULK_MAX_ACTIVE_URBS (1 << BCE_VHCI_BULK_MAX_ACTIVE_URBS_POW2)
+#define BCE_VHCI_ISOC_MAX_ACTIVE_URBS_POW2 2
+#define BCE_VHCI_ISOC_MAX_ACTIVE_URBS (1 << BCE_VHCI_ISOC_MAX_ACTIVE_URBS_POW2)
+/* Lets the next report be posted before the previous one was given back; only used for IN endpoints */
+#define BCE_VHCI_INT_MAX_ACTIVE_URBS_POW2 1
+#define BCE_VHCI_INT_MAX_ACTIVE_URBS (1 << BCE_VHCI_INT_MAX_ACTIVE_URBS_POW2)
+
+#define BCE_VHCI_PORT_STATUS_C_CONNECTION 0x40000
 
 typedef u8 bce_vhci_port_t;
 typedef u8 bce_vhci_device_t;
@@ -155,22 +164,33 @@ static inline int bce_vhci_cmd_device_destroy(struct bce_vhci_command_queue *q,
     return bce_vhci_command_queue_execute(q, &cmd, &res, BCE_VHCI_CMD_TIMEOUT_LONG);
 }
 
-static inline int bce_vhci_cmd_endpoint_create(struct bce_vhci_command_queue *q, bce_vhci_device_t dev,
+static inline void bce_vhci_cmd_endpoint_create_msg(struct bce_vhci_message *cmd, bce_vhci_device_t dev,
         struct usb_endpoint_descriptor *desc)
 {
-    struct bce_vhci_message cmd, res;
     int endpoint_type = usb_endpoint_type(desc);
     int maxp = usb_endpoint_maxp(desc);
     int maxp_burst = usb_endpoint_maxp_mult(desc) * maxp;
     u8 max_active_requests_pow2 = 0;
-    cmd.cmd = BCE_VHCI_CMD_ENDPOINT_CREATE;
-    cmd.param1 = dev | ((desc->bEndpointAddress & 0x8Fu) << 8);
+    cmd->cmd = BCE_VHCI_CMD_ENDPOINT_CREATE;
+    cmd->param1 = dev | ((desc->bEndpointAddress & 0x8Fu) << 8);
     if (endpoint_type == USB_ENDPOINT_XFER_BULK)
         max_active_requests_pow2 = BCE_VHCI_BULK_MAX_ACTIVE_URBS_POW2;
-    cmd.param2 = endpoint_type | ((max_active_requests_pow2 & 0xf) << 4) | (maxp << 16) | ((u64) maxp_burst << 32);
-    if (endpoint_type == USB_ENDPOINT_XFER_INT)
-        cmd.param2 |= (desc->bInterval - 1) << 8;
-    return bce_vhci_command_queue_execute(q, &cmd, &res, BCE_VHCI_CMD_TIMEOUT_SHORT);
+    else if (endpoint_type == USB_ENDPOINT_XFER_ISOC)
+        max_active_requests_pow2 = BCE_VHCI_ISOC_MAX_ACTIVE_URBS_POW2;
+    else if (endpoint_type == USB_ENDPOINT_XFER_INT && usb_endpoint_dir_in(desc))
+        max_active_requests_pow2 = BCE_VHCI_INT_MAX_ACTIVE_URBS_POW2;
+    cmd->param2 = endpoint_type | ((max_active_requests_pow2 & 0xf) << 4) | (maxp << 16) | ((u64) maxp_burst << 32);
+    if (endpoint_type == USB_ENDPOINT_XFER_INT || endpoint_type == USB_ENDPOINT_XFER_ISOC)
+        cmd->param2 |= (desc->bInterval - 1) << 8;
+}
+/* Only queues the command, the reply is collected with bce_vhci_command_queue_wait */
+static inline int bce_vhci_cmd_endpoint_create_submit(struct bce_vhci_command_queue *q,
+        struct bce_vhci_command_queue_completion *c, bce_vhci_device_t dev, struct usb_endpoint_descriptor *desc,
+        struct bce_vhci_message *res)
+{
+    struct bce_vhci_message cmd;
+    bce_vhci_cmd_endpoint_create_msg(&cmd, dev, desc);
+    return bce_vhci_command_queue_submit(q, c, &cmd, res, BCE_VHCI_CMD_TIMEOUT_SHORT);
 }
 static inline int bce_vhci_cmd_endpoint_destroy(struct bce_vhci_command_queue *q, bce_vhci_device_t dev, u8 endpoint)
 {
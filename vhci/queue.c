@@ -23,6 +23,12 @@ int bce_vhci_message_queue_create(struct bce_vhci *vhci, struct bce_vhci_message
         status = -EINVAL;
         goto fail_sq;
     }
+    atomic_set(&ret->claim_tail, 0);
+    ret->publish_tail = 0;
+    memset(ret->slot_seq, 0, sizeof(ret->slot_seq));
+    spin_lock_init(&ret->publish_lock);
+    atomic_set(&ret->publish_contended, 0);
+    atomic_set(&ret->plug_count, 0);
     return 0;
 
 fail_sq:
@@ -44,17 +50,85 @@ void bce_vhci_message_queue_destroy(struct bce_vhci *vhci, struct bce_vhci_messa
     bce_destroy_cq(vhci->dev, q->cq);
 }
 
-void bce_vhci_message_queue_write(struct bce_vhci_message_queue *q, struct bce_vhci_message *req)
+/* Hands every filled slot up to the first one still being written to the device; publish_lock must be held */
+static u32 bce_vhci_message_queue_publish_locked(struct bce_vhci_message_queue *q)
 {
-    int sidx;
+    u32 tail = q->publish_tail;
+    while (smp_load_acquire(&q->slot_seq[tail % VHCI_EVENT_QUEUE_EL_COUNT]) == tail + 1)
+        ++tail;
+    if (tail != q->publish_tail) {
+        WRITE_ONCE(q->publish_tail, tail);
+        q->sq->tail = tail % VHCI_EVENT_QUEUE_EL_COUNT;
+        bce_submit_to_device(q->sq);
+    }
+    return tail;
+}
+
+static void bce_vhci_message_queue_publish(struct bce_vhci_message_queue *q)
+{
+    unsigned long flags;
+    u32 tail;
+    while (true) {
+        /* Either we get the lock, or its holder (or whoever unplugs the queue) is guaranteed to see our slot */
+        smp_mb();
+        /* The plug is shared by all the endpoints using the queue, so overlapping plugs could hold messages back
+         * indefinitely; a full batch is published right away */
+        if (atomic_read(&q->plug_count) && (u32) atomic_read(&q->claim_tail) - READ_ONCE(q->publish_tail) <
+                VHCI_MESSAGE_QUEUE_PLUG_BATCH)
+            return;
+        if (!spin_trylock_irqsave(&q->publish_lock, flags)) {
+            atomic_inc(&q->publish_contended);
+            return;
+        }
+        tail = bce_vhci_message_queue_publish_locked(q);
+        spin_unlock_irqrestore(&q->publish_lock, flags);
+        smp_mb();
+        if (smp_load_acquire(&q->slot_seq[tail % VHCI_EVENT_QUEUE_EL_COUNT]) != tail + 1)
+            return;
+    }
+}
+
+/* The caller must have reserved a submission on q->sq; no lock needs to be held. Returns the sequence number to
+ * pass to bce_vhci_message_queue_sync. */
+u32 bce_vhci_message_queue_write(struct bce_vhci_message_queue *q, struct bce_vhci_message *req)
+{
+    u32 idx, sidx;
     struct bce_qe_submission *s;
-    sidx = q->sq->tail;
-    s = bce_next_submission(q->sq);
+    idx = (u32) atomic_inc_return(&q->claim_tail) - 1;
+    sidx = idx % VHCI_EVENT_QUEUE_EL_COUNT;
     pr_debug("bce-vhci: Send message: %x s=%x p1=%x p2=%llx\n", req->cmd, req->status, req->param1, req->param2);
     q->data[sidx] = *req;
+    s = bce_sq_element(q->sq, (int) sidx);
     bce_set_submission_single(s, q->dma_addr + sizeof(struct bce_vhci_message) * sidx,
             sizeof(struct bce_vhci_message));
-    bce_submit_to_device(q->sq);
+    smp_store_release(&q->slot_seq[sidx], idx + 1);
+    bce_vhci_message_queue_publish(q);
+    return idx + 1;
+}
+
+/* Makes sure the message with the given sequence number was handed to the device, even while other writers keep
+ * the queue plugged. A message claimed before it may still be in the middle of being written on another CPU, so
+ * this spins; it must not be used on a queue with writers that can sleep or be interrupted by the caller. */
+void bce_vhci_message_queue_sync(struct bce_vhci_message_queue *q, u32 seq)
+{
+    unsigned long flags;
+    while ((s32) (READ_ONCE(q->publish_tail) - seq) < 0) {
+        spin_lock_irqsave(&q->publish_lock, flags);
+        bce_vhci_message_queue_publish_locked(q);
+        spin_unlock_irqrestore(&q->publish_lock, flags);
+        cpu_relax();
+    }
+}
+
+void bce_vhci_message_queue_plug(struct bce_vhci_message_queue *q)
+{
+    atomic_inc(&q->plug_count);
+}
+
+void bce_vhci_message_queue_unplug(struct bce_vhci_message_queue *q)
+{
+    if (atomic_dec_and_test(&q->plug_count))
+        bce_vhci_message_queue_publish(q);
 }
 
 static void bce_vhci_message_queue_completion(struct bce_queue_sq *sq)
@@ -84,7 +158,11 @@ int __bce_vhci_event_queue_create(struct bce_vhci *vhci, struct bce_vhci_event_q
     }
 
     init_completion(&ret->queue_empty_completion);
-    bce_vhci_event_queue_submit_pending(ret, VHCI_EVENT_PENDING_COUNT);
+    ret->depth = VHCI_EVENT_PENDING_COUNT;
+    ret->idle_count = 0;
+    ret->starved_count = 0;
+    ret->paused = false;
+    bce_vhci_event_queue_submit_pending(ret, ret->depth);
     return 0;
 }
 
@@ -123,7 +201,7 @@ static void bce_vhci_event_queue_completion(struct bce_queue_sq *sq)
         bce_notify_submission_complete(sq);
         ++cnt;
     }
-    bce_vhci_event_queue_submit_pending(ev, cnt);
+    bce_vhci_event_queue_replenish(ev, cnt);
     if (atomic_read(&sq->available_commands) == sq->el_count - 1)
         complete(&ev->queue_empty_completion);
 }
@@ -131,6 +209,7 @@ static void bce_vhci_event_queue_completion(struct bce_queue_sq *sq)
 void bce_vhci_event_queue_submit_pending(struct bce_vhci_event_queue *q, size_t count)
 {
     int idx;
+    size_t submitted = 0;
     struct bce_qe_submission *s;
     while (count--) {
         if (bce_reserve_submission(q->sq, NULL)) {
@@ -141,13 +220,40 @@ void bce_vhci_event_queue_submit_pending(struct bce_vhci_event_queue *q, size_t
         s = bce_next_submission(q->sq);
         bce_set_submission_single(s,
                                   q->dma_addr + idx * sizeof(struct bce_vhci_message), sizeof(struct bce_vhci_message));
+        ++submitted;
     }
-    bce_submit_to_device(q->sq);
+    if (submitted)
+        bce_submit_to_device(q->sq);
+}
+
+/* Called after handling a batch of events; adapts the posted depth to the load and posts the missing buffers at once */
+void bce_vhci_event_queue_replenish(struct bce_vhci_event_queue *q, size_t consumed)
+{
+    u32 posted = q->sq->el_count - 1 - (u32) atomic_read(&q->sq->available_commands);
+    /* Buffers returned by a flush (aborted) must not be posted again, or pausing the queue would never drain it */
+    if (!consumed || READ_ONCE(q->paused))
+        return;
+    if (posted == 0)
+        ++q->starved_count;
+    if (posted == 0 || consumed * 4 >= q->depth * 3) {
+        q->depth = min_t(u32, q->depth * 2, VHCI_EVENT_PENDING_MAX);
+        q->idle_count = 0;
+    } else if (consumed * 4 < q->depth && q->depth > VHCI_EVENT_PENDING_MIN) {
+        if (++q->idle_count >= VHCI_EVENT_SHRINK_INTERVAL) {
+            q->depth = max_t(u32, q->depth / 2, VHCI_EVENT_PENDING_MIN);
+            q->idle_count = 0;
+        }
+    } else {
+        q->idle_count = 0;
+    }
+    if (posted < q->depth)
+        bce_vhci_event_queue_submit_pending(q, q->depth - posted);
 }
 
 void bce_vhci_event_queue_pause(struct bce_vhci_event_queue *q)
 {
     unsigned long timeout;
+    WRITE_ONCE(q->paused, true);
     reinit_completion(&q->queue_empty_completion);
     if (bce_cmd_flush_memory_queue(q->vhci->dev->cmd_cmdq, q->sq->qid))
         pr_warn("bce-vhci: failed to flush event queue\n");
@@ -163,84 +269,135 @@ void bce_vhci_event_queue_pause(struct bce_vhci_event_queue *q)
 
 void bce_vhci_event_queue_resume(struct bce_vhci_event_queue *q)
 {
+    WRITE_ONCE(q->paused, false);
     if (atomic_read(&q->sq->available_commands) != q->sq->el_count - 1) {
         pr_err("bce-vhci: resume of a queue with pending submissions\n");
         return;
     }
-    bce_vhci_event_queue_submit_pending(q, VHCI_EVENT_PENDING_COUNT);
+    bce_vhci_event_queue_submit_pending(q, q->depth);
 }
 
 void bce_vhci_command_queue_create(struct bce_vhci_command_queue *ret, struct bce_vhci_message_queue *mq)
 {
     ret->mq = mq;
-    ret->completion.result = NULL;
-    init_completion(&ret->completion.completion);
+    INIT_LIST_HEAD(&ret->pending);
     spin_lock_init(&ret->completion_lock);
-    mutex_init(&ret->mutex);
 }
 
 void bce_vhci_command_queue_destroy(struct bce_vhci_command_queue *cq)
 {
-    spin_lock(&cq->completion_lock);
-    if (cq->completion.result) {
-        memset(cq->completion.result, 0, sizeof(struct bce_vhci_message));
-        cq->completion.result->status = BCE_VHCI_ABORT;
-        complete(&cq->completion.completion);
-        cq->completion.result = NULL;
+    unsigned long flags;
+    struct bce_vhci_command_queue_completion *c;
+    spin_lock_irqsave(&cq->completion_lock, flags);
+    while (!list_empty(&cq->pending)) {
+        c = list_first_entry(&cq->pending, struct bce_vhci_command_queue_completion, list);
+        list_del_init(&c->list);
+        memset(c->result, 0, sizeof(struct bce_vhci_message));
+        c->result->status = BCE_VHCI_ABORT;
+        complete(&c->completion);
     }
-    spin_unlock(&cq->completion_lock);
-    mutex_lock(&cq->mutex);
-    mutex_unlock(&cq->mutex);
-    mutex_destroy(&cq->mutex);
+    spin_unlock_irqrestore(&cq->completion_lock, flags);
+}
+
+static struct bce_vhci_command_queue_completion *bce_vhci_command_queue_find(struct bce_vhci_command_queue *cq,
+        struct bce_vhci_message *msg)
+{
+    struct bce_vhci_command_queue_completion *c, *fallback = NULL;
+    u16 cmd = (u16) (msg->cmd & ~0x8000u);
+    /* A reply to a cancellation request (0x4000) can only complete a command we actually tried to cancel */
+    bool cancel = (cmd & 0x4000) != 0;
+    u32 candidates = 0;
+    cmd &= ~0x4000u;
+    list_for_each_entry(c, &cq->pending, list) {
+        if (c->req.cmd != cmd || (cancel && !c->cancelled))
+            continue;
+        if (c->req.param1 == msg->param1)
+            return c;
+        fallback = c;
+        ++candidates;
+    }
+    /* The firmware should echo back param1; only guess when there is no other command the reply could be for */
+    if (candidates != 1)
+        return NULL;
+    pr_warn("bce-vhci: Command reply %x with unexpected p1=%x (expected %x)\n", msg->cmd, msg->param1,
+            fallback->req.param1);
+    return fallback;
 }
 
 void bce_vhci_command_queue_deliver_completion(struct bce_vhci_command_queue *cq, struct bce_vhci_message *msg)
 {
-    struct bce_vhci_command_queue_completion *c = &cq->completion;
+    unsigned long flags;
+    struct bce_vhci_command_queue_completion *c;
 
-    spin_lock(&cq->completion_lock);
-    if (c->result) {
+    spin_lock_irqsave(&cq->completion_lock, flags);
+    c = bce_vhci_command_queue_find(cq, msg);
+    if (c) {
+        list_del_init(&c->list);
         *c->result = *msg;
         complete(&c->completion);
-        c->result = NULL;
+    } else {
+        pr_warn("bce-vhci: Unexpected command reply, dropping: %x s=%x p1=%x p2=%llx\n",
+                msg->cmd, msg->status, msg->param1, msg->param2);
     }
-    spin_unlock(&cq->completion_lock);
+    spin_unlock_irqrestore(&cq->completion_lock, flags);
 }
 
-static int __bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
-        struct bce_vhci_message *res, unsigned long timeout)
+int bce_vhci_command_queue_submit(struct bce_vhci_command_queue *cq, struct bce_vhci_command_queue_completion *c,
+        struct bce_vhci_message *req, struct bce_vhci_message *res, unsigned long timeout)
 {
     int status;
-    struct bce_vhci_command_queue_completion *c;
-    struct bce_vhci_message creq;
-    c = &cq->completion;
+    unsigned long flags;
+
+    INIT_LIST_HEAD(&c->list);
+    init_completion(&c->completion);
+    c->req = *req;
+    c->cancelled = false;
+    c->result = res;
 
     if ((status = bce_reserve_submission(cq->mq->sq, &timeout)))
         return status;
 
-    spin_lock(&cq->completion_lock);
-    c->result = res;
-    reinit_completion(&c->completion);
-    spin_unlock(&cq->completion_lock);
-
+    spin_lock_irqsave(&cq->completion_lock, flags);
+    list_add_tail(&c->list, &cq->pending);
     bce_vhci_message_queue_write(cq->mq, req);
+    spin_unlock_irqrestore(&cq->completion_lock, flags);
+    return 0;
+}
+
+static void bce_vhci_command_queue_forget(struct bce_vhci_command_queue *cq, struct bce_vhci_command_queue_completion *c)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&cq->completion_lock, flags);
+    list_del_init(&c->list);
+    spin_unlock_irqrestore(&cq->completion_lock, flags);
+}
+
+int bce_vhci_command_queue_wait(struct bce_vhci_command_queue *cq, struct bce_vhci_command_queue_completion *c,
+        unsigned long timeout)
+{
+    int status;
+    unsigned long flags;
+    struct bce_vhci_message *res = c->result;
+    struct bce_vhci_message creq;
 
     if (!wait_for_completion_timeout(&c->completion, timeout)) {
         /* we ran out of time, send cancellation */
-        pr_debug("bce-vhci: command timed out req=%x\n", req->cmd);
-        if ((status = bce_reserve_submission(cq->mq->sq, &timeout)))
+        pr_debug("bce-vhci: command timed out req=%x\n", c->req.cmd);
+        if ((status = bce_reserve_submission(cq->mq->sq, &timeout))) {
+            bce_vhci_command_queue_forget(cq, c);
             return status;
+        }
 
-        creq = *req;
+        creq = c->req;
         creq.cmd |= 0x4000;
+        spin_lock_irqsave(&cq->completion_lock, flags);
+        c->cancelled = true;
         bce_vhci_message_queue_write(cq->mq, &creq);
+        spin_unlock_irqrestore(&cq->completion_lock, flags);
 
         if (!wait_for_completion_timeout(&c->completion, 1000)) {
             pr_err("bce-vhci: Possible desync, cmd cancel timed out\n");
-
-            spin_lock(&cq->completion_lock);
-            c->result = NULL;
-            spin_unlock(&cq->completion_lock);
+            bce_vhci_command_queue_forget(cq, c);
             return -ETIMEDOUT;
         }
         if ((res->cmd & ~0x8000) == creq.cmd)
@@ -248,8 +405,8 @@ static int __bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, s
         /* reply for the previous command most likely arrived */
     }
 
-    if ((res->cmd & ~0x8000) != req->cmd) {
-        pr_err("bce-vhci: Possible desync, cmd reply mismatch req=%x, res=%x\n", req->cmd, res->cmd);
+    if ((res->cmd & ~0x8000) != c->req.cmd) {
+        pr_err("bce-vhci: Possible desync, cmd reply mismatch req=%x, res=%x\n", c->req.cmd, res->cmd);
         return -EIO;
     }
     if (res->status == BCE_VHCI_SUCCESS)
@@ -261,8 +418,8 @@ int bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce
                                    struct bce_vhci_message *res, unsigned long timeout)
 {
     int status;
-    mutex_lock(&cq->mutex);
-    status = __bce_vhci_command_queue_execute(cq, req, res, timeout);
-    mutex_unlock(&cq->mutex);
-    return status;
-}
\ No newline at end of file
+    struct bce_vhci_command_queue_completion c;
+    if ((status = bce_vhci_command_queue_submit(cq, &c, req, res, timeout)))
+        return status;
+    return bce_vhci_command_queue_wait(cq, &c, timeout);
+}
@@ -6,6 +6,13 @@
 
 #define VHCI_EVENT_QUEUE_EL_COUNT 256
 #define VHCI_EVENT_PENDING_COUNT 32
+/* The number of posted event buffers adapts to the load between these limits */
+#define VHCI_EVENT_PENDING_MIN 16
+#define VHCI_EVENT_PENDING_MAX (VHCI_EVENT_QUEUE_EL_COUNT - 1)
+/* Number of consecutive lightly loaded completion batches after which the depth is halved */
+#define VHCI_EVENT_SHRINK_INTERVAL 64
+/* Maximum number of messages held back while a message queue is plugged */
+#define VHCI_MESSAGE_QUEUE_PLUG_BATCH 16
 
 struct bce_vhci;
 struct bce_vhci_event_queue;
@@ -33,6 +40,16 @@ struct bce_vhci_message_queue {
     struct bce_queue_sq *sq;
     struct bce_vhci_message *data;
     dma_addr_t dma_addr;
+
+    /* Writers claim slots without taking a lock; whoever gets publish_lock hands every filled slot to the
+     * device in order. slot_seq[i] is the claim index + 1 of the message last written to slot i. */
+    atomic_t claim_tail;
+    u32 publish_tail;
+    u32 slot_seq[VHCI_EVENT_QUEUE_EL_COUNT];
+    struct spinlock publish_lock;
+    atomic_t publish_contended;
+    /* While plugged, written messages are only published by the final unplug or once a batch is complete */
+    atomic_t plug_count;
 };
 typedef void (*bce_vhci_event_queue_callback)(struct bce_vhci_event_queue *q, struct bce_vhci_message *msg);
 struct bce_vhci_event_queue {
@@ -42,21 +59,34 @@ struct bce_vhci_event_queue {
     dma_addr_t dma_addr;
     bce_vhci_event_queue_callback cb;
     struct completion queue_empty_completion;
+    u32 depth;
+    u32 idle_count;
+    /* Number of times all of the posted buffers were used up before we could replenish them */
+    u32 starved_count;
+    /* Set from pause until resume; no buffers are posted in between */
+    bool paused;
 };
+/* A command in flight; replies are matched to it by the command and param1 */
 struct bce_vhci_command_queue_completion {
+    struct list_head list;
+    struct bce_vhci_message req;
     struct bce_vhci_message *result;
     struct completion completion;
+    /* A cancellation request (0x4000) was sent for it, protected by completion_lock */
+    bool cancelled;
 };
 struct bce_vhci_command_queue {
     struct bce_vhci_message_queue *mq;
-    struct bce_vhci_command_queue_completion completion;
+    struct list_head pending;
     struct spinlock completion_lock;
-    struct mutex mutex;
 };
 
 int bce_vhci_message_queue_create(struct bce_vhci *vhci, struct bce_vhci_message_queue *ret, const char *name);
 void bce_vhci_message_queue_destroy(struct bce_vhci *vhci, struct bce_vhci_message_queue *q);
-void bce_vhci_message_queue_write(struct bce_vhci_message_queue *q, struct bce_vhci_message *req);
+u32 bce_vhci_message_queue_write(struct bce_vhci_message_queue *q, struct bce_vhci_message *req);
+void bce_vhci_message_queue_sync(struct bce_vhci_message_queue *q, u32 seq);
+void bce_vhci_message_queue_plug(struct bce_vhci_message_queue *q);
+void bce_vhci_message_queue_unplug(struct bce_vhci_message_queue *q);
 
 int __bce_vhci_event_queue_create(struct bce_vhci *vhci, struct bce_vhci_event_queue *ret, const char *name,
         bce_sq_completion compl);
@@ -64,6 +94,7 @@ int bce_vhci_event_queue_create(struct bce_vhci *vhci, struct bce_vhci_event_que
         bce_vhci_event_queue_callback cb);
 void bce_vhci_event_queue_destroy(struct bce_vhci *vhci, struct bce_vhci_event_queue *q);
 void bce_vhci_event_queue_submit_pending(struct bce_vhci_event_queue *q, size_t count);
+void bce_vhci_event_queue_replenish(struct bce_vhci_event_queue *q, size_t consumed);
 void bce_vhci_event_queue_pause(struct bce_vhci_event_queue *q);
 void bce_vhci_event_queue_resume(struct bce_vhci_event_queue *q);
 
@@ -71,6 +102,10 @@ void bce_vhci_command_queue_create(struct bce_vhci_command_queue *ret, struct bc
 void bce_vhci_command_queue_destroy(struct bce_vhci_command_queue *cq);
 int bce_vhci_command_queue_execute(struct bce_vhci_command_queue *cq, struct bce_vhci_message *req,
         struct bce_vhci_message *res, unsigned long timeout);
+int bce_vhci_command_queue_submit(struct bce_vhci_command_queue *cq, struct bce_vhci_command_queue_completion *c,
+        struct bce_vhci_message *req, struct bce_vhci_message *res, unsigned long timeout);
+int bce_vhci_command_queue_wait(struct bce_vhci_command_queue *cq, struct bce_vhci_command_queue_completion *c,
+        unsigned long timeout);
 void bce_vhci_command_queue_deliver_completion(struct bce_vhci_command_queue *cq, struct bce_vhci_message *msg);
 
 #endif //BCE_VHCI_QUEUE_H
@@ -3,6 +3,22 @@
 #include "vhci.h"
 #include "../pci.h"
 #include <linux/usb/hcd.h>
+#include <linux/mempool.h>
+#include <linux/debugfs.h>
+
+/* Number of elements kept in reserve, so that URBs submitted from atomic context can always be accepted */
+#define BCE_VHCI_URB_POOL_MIN_COUNT 32
+#define BCE_VHCI_CANCEL_WORK_POOL_MIN_COUNT 8
+
+static struct kmem_cache *bce_vhci_urb_cache;
+static struct kmem_cache *bce_vhci_cancel_work_cache;
+static mempool_t *bce_vhci_urb_pool;
+static mempool_t *bce_vhci_cancel_work_pool;
+
+static atomic_t bce_vhci_urb_alloc_count;
+static atomic_t bce_vhci_urb_active_count;
+static atomic_t bce_vhci_cancel_work_alloc_count;
+static atomic_t bce_vhci_alloc_fail_count;
 
 static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq);
 static void bce_vhci_transfer_queue_giveback(struct bce_vhci_transfer_queue *q);
@@ -10,117 +26,348 @@ static void bce_vhci_transfer_queue_remove_pending(struct bce_vhci_transfer_queu
 
 static int bce_vhci_urb_init(struct bce_vhci_urb *vurb);
 static int bce_vhci_urb_update(struct bce_vhci_urb *urb, struct bce_vhci_message *msg);
-static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c);
+static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_queue_sq *sq,
+        struct bce_sq_completion_data *c);
 
-static void bce_vhci_transfer_queue_reset_w(struct work_struct *work);
+static void bce_vhci_transfer_queue_state_w(struct work_struct *work);
+static void bce_vhci_transfer_queue_bus_w(struct work_struct *work);
+static int bce_vhci_transfer_queue_register(struct bce_vhci_transfer_queue *q);
+static void bce_vhci_urb_complete(struct bce_vhci_urb *urb, int status);
 
-void bce_vhci_create_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q,
-        struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir)
+struct bce_vhci_transfer_queue *bce_vhci_create_transfer_queue(struct bce_vhci *vhci,
+        struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir,
+        struct bce_queue_cq *shared_cq)
 {
-    char name[0x21];
-    INIT_LIST_HEAD(&q->evq);
+    struct bce_vhci_transfer_queue *q = kzalloc(sizeof(struct bce_vhci_transfer_queue), GFP_KERNEL);
+    if (!q)
+        return NULL;
     INIT_LIST_HEAD(&q->giveback_urb_list);
+    INIT_LIST_HEAD(&q->cancel_list);
+    init_waitqueue_head(&q->out_drain_wq);
     spin_lock_init(&q->urb_lock);
     mutex_init(&q->pause_lock);
     q->vhci = vhci;
     q->endp = endp;
     q->dev_addr = dev_addr;
     q->endp_addr = (u8) (endp->desc.bEndpointAddress & 0x8F);
+    q->dir = dir;
     q->state = BCE_VHCI_ENDPOINT_ACTIVE;
     q->active = true;
     q->stalled = false;
+    q->registered = false;
+    q->create_pending = false;
     q->max_active_requests = 1;
     if (usb_endpoint_type(&endp->desc) == USB_ENDPOINT_XFER_BULK)
         q->max_active_requests = BCE_VHCI_BULK_MAX_ACTIVE_URBS;
+    else if (usb_endpoint_type(&endp->desc) == USB_ENDPOINT_XFER_ISOC)
+        q->max_active_requests = BCE_VHCI_ISOC_MAX_ACTIVE_URBS;
+    else if (usb_endpoint_is_int_in(&endp->desc))
+        q->max_active_requests = BCE_VHCI_INT_MAX_ACTIVE_URBS;
     q->remaining_active_requests = q->max_active_requests;
-    q->cq = bce_create_cq(vhci->dev, 0x100);
-    INIT_WORK(&q->w_reset, bce_vhci_transfer_queue_reset_w);
+    if (usb_endpoint_xfer_int(&endp->desc))
+        q->msg_queue = &vhci->msg_interrupt;
+    else if (usb_endpoint_xfer_isoc(&endp->desc))
+        q->msg_queue = &vhci->msg_isochronous;
+    else
+        q->msg_queue = &vhci->msg_asynchronous;
+    /* The firmware won't issue more transfer requests than there can be active URBs, leave some room for
+     * control transfer status events */
+    q->evq_size = roundup_pow_of_two(max_t(u32, q->max_active_requests * 2,
+            BCE_VHCI_TRANSFER_QUEUE_MIN_DEFERRED_EVENTS));
+    q->evq = kcalloc(q->evq_size, sizeof(struct bce_vhci_message), GFP_KERNEL);
+    if (!q->evq) {
+        kfree(q);
+        return NULL;
+    }
+    q->evq_head = q->evq_count = 0;
+    q->evq_overflow_count = 0;
+    /* Completions are routed to the SQ by qid, so the endpoints of a device can share a single CQ. Isochronous
+     * endpoints can have a lot more submissions in flight than the others, so they always get a dedicated one. */
+    q->owns_cq = !shared_cq || usb_endpoint_xfer_isoc(&endp->desc);
+    q->cq = q->owns_cq ? NULL : shared_cq;
     q->sq_in = NULL;
-    if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        snprintf(name, sizeof(name), "VHC1-%i-%02x", dev_addr, 0x80 | usb_endpoint_num(&endp->desc));
-        q->sq_in = bce_create_sq(vhci->dev, q->cq, name, 0x100, DMA_FROM_DEVICE,
+    q->sq_out = NULL;
+    q->plug_depth = 0;
+    q->sq_in_pending = false;
+    INIT_WORK(&q->w_state, bce_vhci_transfer_queue_state_w);
+    INIT_WORK(&q->w_bus, bce_vhci_transfer_queue_bus_w);
+
+    if (bce_vhci_transfer_queue_register(q)) {
+        kfree(q->evq);
+        kfree(q);
+        return NULL;
+    }
+    return q;
+}
+
+static u32 bce_vhci_transfer_queue_sq_el_count(struct bce_vhci_transfer_queue *q)
+{
+    u32 per_request = 1;
+    /* Every isochronous packet is a separate submission and we don't know how many packets the URBs will have */
+    if (usb_endpoint_xfer_isoc(&q->endp->desc))
+        return BCE_VHCI_ISOC_SQ_EL_COUNT;
+    /* Control requests need both the setup packet and the data stage */
+    if (usb_endpoint_xfer_control(&q->endp->desc))
+        per_request = 2;
+    /* One element is always kept free by bce_reserve_submission */
+    return roundup_pow_of_two(max_t(u32, q->max_active_requests * per_request + 1, BCE_VHCI_MIN_SQ_EL_COUNT));
+}
+
+static void bce_vhci_transfer_queue_destroy_queues(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci *vhci = q->vhci;
+    if (q->sq_out)
+        bce_destroy_sq(vhci->dev, q->sq_out);
+    if (q->sq_in)
+        bce_destroy_sq(vhci->dev, q->sq_in);
+    if (q->owns_cq && q->cq)
+        bce_destroy_cq(vhci->dev, q->cq);
+    q->sq_out = q->sq_in = NULL;
+    if (q->owns_cq)
+        q->cq = NULL;
+}
+
+/* Only submits the ENDPOINT_CREATE command, registration completes in bce_vhci_transfer_queue_finish_register */
+static int bce_vhci_transfer_queue_register(struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci *vhci = q->vhci;
+    char name[0x21];
+    u32 el_count = bce_vhci_transfer_queue_sq_el_count(q);
+    int status;
+
+    /* The queues may still exist from before a port reset, see bce_vhci_transfer_queue_rebind */
+    if (q->owns_cq && !q->cq) {
+        q->cq = bce_create_cq(vhci->dev, el_count);
+        if (!q->cq)
+            return -ENOMEM;
+    }
+    if ((q->dir == DMA_FROM_DEVICE || q->dir == DMA_BIDIRECTIONAL) && !q->sq_in) {
+        snprintf(name, sizeof(name), "VHC1-%i-%02x", q->dev_addr, 0x80 | usb_endpoint_num(&q->endp->desc));
+        q->sq_in = bce_create_sq(vhci->dev, q->cq, name, el_count, DMA_FROM_DEVICE,
                                  bce_vhci_transfer_queue_completion, q);
+        if (!q->sq_in) {
+            status = -ENOMEM;
+            goto fail;
+        }
     }
-    q->sq_out = NULL;
-    if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        snprintf(name, sizeof(name), "VHC1-%i-%02x", dev_addr, usb_endpoint_num(&endp->desc));
-        q->sq_out = bce_create_sq(vhci->dev, q->cq, name, 0x100, DMA_TO_DEVICE,
+    if ((q->dir == DMA_TO_DEVICE || q->dir == DMA_BIDIRECTIONAL) && !q->sq_out) {
+        snprintf(name, sizeof(name), "VHC1-%i-%02x", q->dev_addr, usb_endpoint_num(&q->endp->desc));
+        q->sq_out = bce_create_sq(vhci->dev, q->cq, name, el_count, DMA_TO_DEVICE,
                                   bce_vhci_transfer_queue_completion, q);
+        if (!q->sq_out) {
+            status = -ENOMEM;
+            goto fail;
+        }
+    }
+    /* The firmware endpoint is only created once its queues exist */
+    if ((status = bce_vhci_cmd_endpoint_create_submit(&vhci->cq, &q->create_c, q->dev_addr, &q->endp->desc,
+            &q->create_res)))
+        goto fail;
+    q->create_pending = true;
+    return 0;
+
+fail:
+    pr_err("bce-vhci: [%02x] Failed to register the transfer queue (%i)\n", q->endp_addr, status);
+    bce_vhci_transfer_queue_destroy_queues(q);
+    return status;
+}
+
+/* Must be called with pause_lock held, unless the queue isn't published yet or anymore */
+static int bce_vhci_transfer_queue_finish_register(struct bce_vhci_transfer_queue *q)
+{
+    unsigned long flags;
+    int status;
+    if (!q->create_pending)
+        return 0;
+    q->create_pending = false;
+    status = bce_vhci_command_queue_wait(&q->vhci->cq, &q->create_c, BCE_VHCI_CMD_TIMEOUT_SHORT);
+    if (status) {
+        pr_err("bce-vhci: [%02x] Failed to create the firmware endpoint (%i)\n", q->endp_addr, status);
+        bce_vhci_transfer_queue_destroy_queues(q);
+        /* Firmware status codes are positive */
+        return status < 0 ? status : -EIO;
     }
+    spin_lock_irqsave(&q->urb_lock, flags);
+    q->registered = true;
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    return 0;
+}
+
+/* Waits for the firmware endpoint submitted by bce_vhci_create_transfer_queue to be created */
+int bce_vhci_transfer_queue_wait_registered(struct bce_vhci_transfer_queue *q)
+{
+    int status;
+    mutex_lock(&q->pause_lock);
+    status = bce_vhci_transfer_queue_finish_register(q);
+    mutex_unlock(&q->pause_lock);
+    return status;
 }
 
+static void bce_vhci_transfer_queue_process_cancels(struct bce_vhci_transfer_queue *q);
+
 void bce_vhci_destroy_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q)
 {
+    cancel_work_sync(&q->w_state);
+    cancel_work_sync(&q->w_bus);
+    /* The command completion lives in the queue, so a pending ENDPOINT_CREATE has to be waited for */
+    bce_vhci_transfer_queue_finish_register(q);
+    /* The queue is already paused, so this does not involve the firmware */
+    bce_vhci_transfer_queue_process_cancels(q);
     bce_vhci_transfer_queue_giveback(q);
     bce_vhci_transfer_queue_remove_pending(q);
-    if (q->sq_in)
-        bce_destroy_sq(vhci->dev, q->sq_in);
-    if (q->sq_out)
-        bce_destroy_sq(vhci->dev, q->sq_out);
-    bce_destroy_cq(vhci->dev, q->cq);
+    if (q->registered)
+        bce_vhci_cmd_endpoint_destroy(&vhci->cq, q->dev_addr, q->endp_addr);
+    bce_vhci_transfer_queue_destroy_queues(q);
+    q->registered = false;
+    if (q->evq_overflow_count)
+        pr_warn("bce-vhci: [%02x] %u deferred events were dropped\n", q->endp_addr, q->evq_overflow_count);
+    kfree(q->evq);
+    if (q->endp->hcpriv == q)
+        q->endp->hcpriv = NULL;
+    kfree(q);
+}
+
+void bce_vhci_transfer_queue_unbind(struct bce_vhci_transfer_queue *q)
+{
+    unsigned long flags;
+    mutex_lock(&q->pause_lock);
+    bce_vhci_transfer_queue_finish_register(q);
+    bce_vhci_transfer_queue_remove_pending(q);
+    if (q->registered)
+        bce_vhci_cmd_endpoint_destroy(&q->vhci->cq, q->dev_addr, q->endp_addr);
+    spin_lock_irqsave(&q->urb_lock, flags);
+    q->registered = false;
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    mutex_unlock(&q->pause_lock);
+}
+
+int bce_vhci_transfer_queue_rebind(struct bce_vhci_transfer_queue *q, bce_vhci_device_t dev_addr)
+{
+    struct bce_vhci *vhci = q->vhci;
+    int status;
+    mutex_lock(&q->pause_lock);
+    /* The firmware finds the queues of an endpoint by name, which includes the device id */
+    if (dev_addr != q->dev_addr) {
+        if (q->sq_in)
+            bce_destroy_sq(vhci->dev, q->sq_in);
+        if (q->sq_out)
+            bce_destroy_sq(vhci->dev, q->sq_out);
+        q->sq_in = q->sq_out = NULL;
+        q->dev_addr = dev_addr;
+    }
+    status = bce_vhci_transfer_queue_register(q);
+    if (!status)
+        status = bce_vhci_transfer_queue_finish_register(q);
+    mutex_unlock(&q->pause_lock);
+    return status;
+}
+
+/* Gives back all the URBs of a queue which could not be bound to the firmware device again */
+void bce_vhci_transfer_queue_abort(struct bce_vhci_transfer_queue *q, int status)
+{
+    unsigned long flags;
+    struct urb *urb, *urbt;
+    spin_lock_irqsave(&q->urb_lock, flags);
+    list_for_each_entry_safe(urb, urbt, &q->endp->urb_list, urb_list)
+        bce_vhci_urb_complete(urb->hcpriv, status);
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    bce_vhci_transfer_queue_giveback(q);
 }
 
 static inline bool bce_vhci_transfer_queue_can_init_urb(struct bce_vhci_transfer_queue *q)
 {
-    return q->remaining_active_requests > 0;
+    return q->registered && q->remaining_active_requests > 0;
 }
 
 static void bce_vhci_transfer_queue_defer_event(struct bce_vhci_transfer_queue *q, struct bce_vhci_message *msg)
 {
-    struct bce_vhci_list_message *lm;
-    lm = kmalloc(sizeof(struct bce_vhci_list_message), GFP_KERNEL);
-    INIT_LIST_HEAD(&lm->list);
-    lm->msg = *msg;
-    list_add_tail(&lm->list, &q->evq);
+    if (q->evq_count == q->evq_size) {
+        ++q->evq_overflow_count;
+        pr_err("bce-vhci: [%02x] Deferred event queue overflow, dropping event %x\n", q->endp_addr, msg->cmd);
+        return;
+    }
+    q->evq[(q->evq_head + q->evq_count) & (q->evq_size - 1)] = *msg;
+    ++q->evq_count;
 }
 
 static void bce_vhci_transfer_queue_giveback(struct bce_vhci_transfer_queue *q)
 {
     unsigned long flags;
-    struct urb *urb;
+    struct urb *urb, *urbt;
+    LIST_HEAD(giveback);
     spin_lock_irqsave(&q->urb_lock, flags);
-    while (!list_empty(&q->giveback_urb_list)) {
-        urb = list_first_entry(&q->giveback_urb_list, struct urb, urb_list);
-        list_del(&urb->urb_list);
+    list_splice_init(&q->giveback_urb_list, &giveback);
+    spin_unlock_irqrestore(&q->urb_lock, flags);
 
-        spin_unlock_irqrestore(&q->urb_lock, flags);
+    /* With HCD_BH this only queues the URBs for usbcore, the completion handlers run later from its BH */
+    list_for_each_entry_safe(urb, urbt, &giveback, urb_list) {
+        list_del_init(&urb->urb_list);
+        if (q->endp_addr == 0)
+            bce_vhci_desc_cache_update(q->vhci, urb);
         usb_hcd_giveback_urb(q->vhci->hcd, urb, urb->status);
-        spin_lock_irqsave(&q->urb_lock, flags);
     }
-    spin_unlock_irqrestore(&q->urb_lock, flags);
 }
 
 static void bce_vhci_transfer_queue_init_pending_urbs(struct bce_vhci_transfer_queue *q);
 
+/* Batches the messages and IN submissions of several URBs; must be called with urb_lock held */
+static void bce_vhci_transfer_queue_plug(struct bce_vhci_transfer_queue *q)
+{
+    bce_vhci_message_queue_plug(q->msg_queue);
+    ++q->plug_depth;
+}
+
+/* The transfer request messages need to reach the firmware before the data submissions. Another endpoint may
+ * still hold the plug of the shared message queue, so ours are published explicitly first; all the writers of the
+ * transfer message queues hold an urb_lock. */
+static void bce_vhci_transfer_queue_ring_in(struct bce_vhci_transfer_queue *q)
+{
+    bce_vhci_message_queue_sync(q->msg_queue, q->msg_seq);
+    bce_submit_to_device(q->sq_in);
+}
+
+static void bce_vhci_transfer_queue_unplug(struct bce_vhci_transfer_queue *q)
+{
+    bce_vhci_message_queue_unplug(q->msg_queue);
+    if (--q->plug_depth == 0 && q->sq_in_pending) {
+        q->sq_in_pending = false;
+        bce_vhci_transfer_queue_ring_in(q);
+    }
+}
+
+static void bce_vhci_transfer_queue_submit_in(struct bce_vhci_transfer_queue *q)
+{
+    if (q->plug_depth)
+        q->sq_in_pending = true;
+    else
+        bce_vhci_transfer_queue_ring_in(q);
+}
+
 static void bce_vhci_transfer_queue_deliver_pending(struct bce_vhci_transfer_queue *q)
 {
     struct urb *urb;
-    struct bce_vhci_list_message *lm;
 
-    while (!list_empty(&q->endp->urb_list) && !list_empty(&q->evq)) {
+    bce_vhci_transfer_queue_plug(q);
+
+    while (!list_empty(&q->endp->urb_list) && q->evq_count) {
         urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
 
-        lm = list_first_entry(&q->evq, struct bce_vhci_list_message, list);
-        if (bce_vhci_urb_update(urb->hcpriv, &lm->msg) == -EAGAIN)
+        if (bce_vhci_urb_update(urb->hcpriv, &q->evq[q->evq_head]) == -EAGAIN)
             break;
-        list_del(&lm->list);
-        kfree(lm);
+        q->evq_head = (q->evq_head + 1) & (q->evq_size - 1);
+        --q->evq_count;
     }
 
     /* some of the URBs could have been completed, so initialize more URBs if possible */
     bce_vhci_transfer_queue_init_pending_urbs(q);
+    bce_vhci_transfer_queue_unplug(q);
 }
 
 static void bce_vhci_transfer_queue_remove_pending(struct bce_vhci_transfer_queue *q)
 {
     unsigned long flags;
-    struct bce_vhci_list_message *lm;
     spin_lock_irqsave(&q->urb_lock, flags);
-    while (!list_empty(&q->evq)) {
-        lm = list_first_entry(&q->evq, struct bce_vhci_list_message, list);
-        list_del(&lm->list);
-        kfree(lm);
-    }
+    q->evq_head = q->evq_count = 0;
     spin_unlock_irqrestore(&q->urb_lock, flags);
 }
 
@@ -133,7 +380,7 @@ void bce_vhci_transfer_queue_event(struct bce_vhci_transfer_queue *q, struct bce
     bce_vhci_transfer_queue_deliver_pending(q);
 
     if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST &&
-        (!list_empty(&q->evq) || list_empty(&q->endp->urb_list))) {
+        (q->evq_count || list_empty(&q->endp->urb_list))) {
         bce_vhci_transfer_queue_defer_event(q, msg);
         goto complete;
     }
@@ -169,29 +416,46 @@ static void bce_vhci_transfer_queue_completion(struct bce_queue_sq *sq)
         }
         if (list_empty(&q->endp->urb_list)) {
             pr_err("bce-vhci: [%02x] Got a completion while no requests are pending\n", q->endp_addr);
+            bce_notify_submission_complete(sq);
             continue;
         }
         pr_debug("bce-vhci: [%02x] Got a transfer queue completion\n", q->endp_addr);
         urb = list_first_entry(&q->endp->urb_list, struct urb, urb_list);
-        bce_vhci_urb_transfer_completion(urb->hcpriv, c);
+        bce_vhci_urb_transfer_completion(urb->hcpriv, sq, c);
         bce_notify_submission_complete(sq);
     }
     bce_vhci_transfer_queue_deliver_pending(q);
     spin_unlock_irqrestore(&q->urb_lock, flags);
     bce_vhci_transfer_queue_giveback(q);
+    if (sq == q->sq_out)
+        wake_up(&q->out_drain_wq);
+}
+
+static bool bce_vhci_transfer_queue_out_drained(struct bce_vhci_transfer_queue *q)
+{
+    /* One element is always kept free by bce_reserve_submission */
+    return atomic_read(&q->sq_out->available_commands) == q->sq_out->el_count - 1;
 }
 
-int bce_vhci_transfer_queue_do_pause(struct bce_vhci_transfer_queue *q)
+int bce_vhci_transfer_queue_do_pause(struct bce_vhci_transfer_queue *q, enum bce_vhci_pause_source src)
 {
     unsigned long flags;
     int status;
+    bool drain;
     u8 endp_addr = (u8) (q->endp->desc.bEndpointAddress & 0x8F);
     spin_lock_irqsave(&q->urb_lock, flags);
     q->active = false;
+    /* The device is recreated after a shutdown pause (reset) and loses the data anyway; a stalled endpoint won't
+     * consume anything anymore */
+    drain = q->sq_out && src != BCE_VHCI_PAUSE_SHUTDOWN && !q->stalled;
     spin_unlock_irqrestore(&q->urb_lock, flags);
-    if (q->sq_out) {
-        pr_err("bce-vhci: Not implemented: wait for pending output requests\n");
-    }
+    if (!q->registered) /* the firmware endpoint is gone while the device is being reset */
+        return 0;
+    /* No new OUT data is posted once the queue is inactive, let the firmware consume what it already has so it
+     * doesn't need to be sent again after the flush */
+    if (drain && !wait_event_timeout(q->out_drain_wq, bce_vhci_transfer_queue_out_drained(q),
+            BCE_VHCI_OUT_DRAIN_TIMEOUT))
+        pr_warn("bce-vhci: [%02x] Timed out waiting for pending OUT requests, they will be resent\n", q->endp_addr);
     bce_vhci_transfer_queue_remove_pending(q);
     if ((status = bce_vhci_cmd_endpoint_set_state(
             &q->vhci->cq, q->dev_addr, endp_addr, BCE_VHCI_ENDPOINT_PAUSED, &q->state)))
@@ -214,24 +478,29 @@ int bce_vhci_transfer_queue_do_resume(struct bce_vhci_transfer_queue *q)
     struct urb *urb, *urbt;
     struct bce_vhci_urb *vurb;
     u8 endp_addr = (u8) (q->endp->desc.bEndpointAddress & 0x8F);
-    if ((status = bce_vhci_cmd_endpoint_set_state(
-            &q->vhci->cq, q->dev_addr, endp_addr, BCE_VHCI_ENDPOINT_ACTIVE, &q->state)))
-        return status;
-    if (q->state != BCE_VHCI_ENDPOINT_ACTIVE)
-        return -EINVAL;
+    if (q->registered) {
+        if ((status = bce_vhci_cmd_endpoint_set_state(
+                &q->vhci->cq, q->dev_addr, endp_addr, BCE_VHCI_ENDPOINT_ACTIVE, &q->state)))
+            return status;
+        if (q->state != BCE_VHCI_ENDPOINT_ACTIVE)
+            return -EINVAL;
+    }
     spin_lock_irqsave(&q->urb_lock, flags);
     q->active = true;
+    bce_vhci_transfer_queue_plug(q);
     list_for_each_entry_safe(urb, urbt, &q->endp->urb_list, urb_list) {
         vurb = urb->hcpriv;
         if (vurb->state == BCE_VHCI_URB_INIT_PENDING) {
             if (!bce_vhci_transfer_queue_can_init_urb(q))
                 break;
-            bce_vhci_urb_init(vurb);
+            if ((status = bce_vhci_urb_init(vurb)))
+                bce_vhci_urb_complete(vurb, status);
         } else {
             bce_vhci_urb_resume(vurb);
         }
     }
     bce_vhci_transfer_queue_deliver_pending(q);
+    bce_vhci_transfer_queue_unplug(q);
     spin_unlock_irqrestore(&q->urb_lock, flags);
     return 0;
 }
@@ -242,7 +511,7 @@ int bce_vhci_transfer_queue_pause(struct bce_vhci_transfer_queue *q, enum bce_vh
     mutex_lock(&q->pause_lock);
     if ((q->paused_by & src) != src) {
         if (!q->paused_by)
-            ret = bce_vhci_transfer_queue_do_pause(q);
+            ret = bce_vhci_transfer_queue_do_pause(q, src);
         if (!ret)
             q->paused_by |= src;
     }
@@ -264,10 +533,9 @@ int bce_vhci_transfer_queue_resume(struct bce_vhci_transfer_queue *q, enum bce_v
     return ret;
 }
 
-static void bce_vhci_transfer_queue_reset_w(struct work_struct *work)
+static void bce_vhci_transfer_queue_reset(struct bce_vhci_transfer_queue *q)
 {
     unsigned long flags;
-    struct bce_vhci_transfer_queue *q = container_of(work, struct bce_vhci_transfer_queue, w_reset);
 
     mutex_lock(&q->pause_lock);
     spin_lock_irqsave(&q->urb_lock, flags);
@@ -292,21 +560,72 @@ static void bce_vhci_transfer_queue_reset_w(struct work_struct *work)
     bce_vhci_transfer_queue_resume(q, BCE_VHCI_PAUSE_INTERNAL_WQ);
 }
 
+static void bce_vhci_transfer_queue_state_w(struct work_struct *work)
+{
+    struct bce_vhci_transfer_queue *q = container_of(work, struct bce_vhci_transfer_queue, w_state);
+    unsigned long flags;
+    bool fw_pause;
+
+    spin_lock_irqsave(&q->urb_lock, flags);
+    fw_pause = q->fw_pause;
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    if (fw_pause)
+        bce_vhci_transfer_queue_pause(q, BCE_VHCI_PAUSE_FIRMWARE);
+    else
+        bce_vhci_transfer_queue_resume(q, BCE_VHCI_PAUSE_FIRMWARE);
+
+    bce_vhci_transfer_queue_reset(q);
+    bce_vhci_transfer_queue_process_cancels(q);
+}
+
+/* Pausing may wait for the OUT data to drain, which must not hold up the other firmware events, so firmware
+ * requests only record the wanted state; the latest one is applied from the state work */
+void bce_vhci_transfer_queue_request_firmware_pause(struct bce_vhci_transfer_queue *q, bool pause)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&q->urb_lock, flags);
+    q->fw_pause = pause;
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    queue_work(q->vhci->tq_state_wq, &q->w_state);
+}
+
 void bce_vhci_transfer_queue_request_reset(struct bce_vhci_transfer_queue *q)
 {
-    queue_work(q->vhci->tq_state_wq, &q->w_reset);
+    queue_work(q->vhci->tq_state_wq, &q->w_state);
+}
+
+static void bce_vhci_transfer_queue_bus_w(struct work_struct *work)
+{
+    struct bce_vhci_transfer_queue *q = container_of(work, struct bce_vhci_transfer_queue, w_bus);
+    if (q->bus_pause)
+        bce_vhci_transfer_queue_pause(q, BCE_VHCI_PAUSE_SUSPEND);
+    else
+        bce_vhci_transfer_queue_resume(q, BCE_VHCI_PAUSE_SUSPEND);
+}
+
+/* Pauses or resumes the queue for bus suspend from tq_state_wq, bce_vhci_transfer_queue_bus_wait waits for it */
+void bce_vhci_transfer_queue_bus_pause_async(struct bce_vhci_transfer_queue *q, bool pause)
+{
+    q->bus_pause = pause;
+    queue_work(q->vhci->tq_state_wq, &q->w_bus);
+}
+
+void bce_vhci_transfer_queue_bus_wait(struct bce_vhci_transfer_queue *q)
+{
+    flush_work(&q->w_bus);
 }
 
 static void bce_vhci_transfer_queue_init_pending_urbs(struct bce_vhci_transfer_queue *q)
 {
     struct urb *urb, *urbt;
     struct bce_vhci_urb *vurb;
+    int status;
     list_for_each_entry_safe(urb, urbt, &q->endp->urb_list, urb_list) {
         vurb = urb->hcpriv;
         if (!bce_vhci_transfer_queue_can_init_urb(q))
             break;
-        if (vurb->state == BCE_VHCI_URB_INIT_PENDING)
-            bce_vhci_urb_init(vurb);
+        if (vurb->state == BCE_VHCI_URB_INIT_PENDING && (status = bce_vhci_urb_init(vurb)))
+            bce_vhci_urb_complete(vurb, status);
     }
 }
 
@@ -314,28 +633,59 @@ static void bce_vhci_transfer_queue_init_pending_urbs(struct bce_vhci_transfer_q
 
 static int bce_vhci_urb_data_start(struct bce_vhci_urb *urb, unsigned long *timeout);
 
-int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb)
+static struct bce_vhci_urb *bce_vhci_urb_alloc(gfp_t mem_flags)
+{
+    struct bce_vhci_urb *vurb = mempool_alloc(bce_vhci_urb_pool, mem_flags);
+    if (!vurb) {
+        atomic_inc(&bce_vhci_alloc_fail_count);
+        return NULL;
+    }
+    memset(vurb, 0, sizeof(struct bce_vhci_urb));
+    atomic_inc(&bce_vhci_urb_alloc_count);
+    atomic_inc(&bce_vhci_urb_active_count);
+    return vurb;
+}
+
+static void bce_vhci_urb_free(struct bce_vhci_urb *vurb)
+{
+    atomic_dec(&bce_vhci_urb_active_count);
+    mempool_free(vurb, bce_vhci_urb_pool);
+}
+
+int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb, gfp_t mem_flags)
 {
     unsigned long flags;
     int status = 0;
     struct bce_vhci_urb *vurb;
-    vurb = kzalloc(sizeof(struct bce_vhci_urb), GFP_KERNEL);
+    if (usb_pipeisoc(urb->pipe) && usb_urb_dir_in(urb) && urb->number_of_packets > BCE_VHCI_ISOC_MAX_PACKETS)
+        return -EFBIG;
+    vurb = bce_vhci_urb_alloc(mem_flags);
+    if (!vurb)
+        return -ENOMEM;
     urb->hcpriv = vurb;
 
     vurb->q = q;
     vurb->urb = urb;
     vurb->dir = usb_urb_dir_in(urb) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
     vurb->is_control = (usb_endpoint_num(&urb->ep->desc) == 0);
+    vurb->is_isoc = usb_pipeisoc(urb->pipe);
+    if (vurb->is_isoc)
+        urb->error_count = 0;
 
     spin_lock_irqsave(&q->urb_lock, flags);
     status = usb_hcd_link_urb_to_ep(q->vhci->hcd, urb);
     if (status) {
         spin_unlock_irqrestore(&q->urb_lock, flags);
         urb->hcpriv = NULL;
-        kfree(vurb);
+        bce_vhci_urb_free(vurb);
         return status;
     }
+    /* The firmware schedules the packets on its own right after the ones already queued, so only a URB which
+     * starts a new stream can be placed; the start frame of other URBs is kept as requested by the driver */
+    if (vurb->is_isoc && ((urb->transfer_flags & URB_ISO_ASAP) || list_is_first(&urb->urb_list, &q->endp->urb_list)))
+        urb->start_frame = usb_hcd_get_frame_number(urb->dev);
 
+    bce_vhci_transfer_queue_plug(q);
     if (q->active) {
         if (bce_vhci_transfer_queue_can_init_urb(vurb->q))
             status = bce_vhci_urb_init(vurb);
@@ -349,10 +699,11 @@ int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb)
     if (status) {
         usb_hcd_unlink_urb_from_ep(q->vhci->hcd, urb);
         urb->hcpriv = NULL;
-        kfree(vurb);
+        bce_vhci_urb_free(vurb);
     } else {
         bce_vhci_transfer_queue_deliver_pending(q);
     }
+    bce_vhci_transfer_queue_unplug(q);
     spin_unlock_irqrestore(&q->urb_lock, flags);
     pr_debug("bce-vhci: [%02x] URB enqueued (dir = %s, size = %i)\n", q->endp_addr,
             usb_urb_dir_in(urb) ? "IN" : "OUT", urb->transfer_buffer_length);
@@ -391,7 +742,7 @@ static void bce_vhci_urb_complete(struct bce_vhci_urb *urb, int status)
     real_urb->status = status;
     if (urb->state != BCE_VHCI_URB_INIT_PENDING)
         ++urb->q->remaining_active_requests;
-    kfree(urb);
+    bce_vhci_urb_free(urb);
     list_add_tail(&real_urb->urb_list, &q->giveback_urb_list);
 }
 
@@ -420,27 +771,82 @@ static int bce_vhci_urb_remove(struct bce_vhci_transfer_queue *q, struct urb *ur
     if (ret)
         return ret;
     vurb = urb->hcpriv;
-    kfree(vurb);
+    bce_vhci_urb_free(vurb);
     usb_hcd_giveback_urb(q->vhci->hcd, urb, status);
     return 0;
 }
 
-static void bce_vhci_urb_cancel_w(struct work_struct *ws)
+/* Whether nothing of the URB has been handed to the firmware yet */
+static bool bce_vhci_urb_is_host_only(struct bce_vhci_urb *vurb)
+{
+    switch (vurb->state) {
+        case BCE_VHCI_URB_INIT_PENDING:
+        case BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_REQUEST:
+            return true;
+        case BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST:
+            if (vurb->is_control)
+                return false;
+            return vurb->is_isoc ? vurb->iso_send_packet == 0 : vurb->send_offset == 0;
+        default:
+            return false;
+    }
+}
+
+/* Must be called with urb_lock held. Returns false if the queue needs to be paused to remove the URB. */
+static bool bce_vhci_urb_try_remove_host_only(struct bce_vhci_transfer_queue *q, struct urb *urb, int status)
 {
-    struct bce_vhci_transfer_queue_urb_cancel_work *w =
-            container_of(ws, struct bce_vhci_transfer_queue_urb_cancel_work, ws);
+    struct bce_vhci_urb *vurb;
+    if (usb_hcd_check_unlink_urb(q->vhci->hcd, urb, 0))
+        return true; /* already completed */
+    vurb = urb->hcpriv;
+    if (!bce_vhci_urb_is_host_only(vurb))
+        return false;
+    bce_vhci_urb_complete(vurb, status);
+    if (q->active)
+        bce_vhci_transfer_queue_deliver_pending(q);
+    return true;
+}
 
-    pr_debug("bce-vhci: [%02x] Cancelling URB\n", w->q->endp_addr);
-    bce_vhci_transfer_queue_pause(w->q, BCE_VHCI_PAUSE_INTERNAL_WQ);
-    bce_vhci_urb_remove(w->q, w->urb, w->status);
-    bce_vhci_transfer_queue_resume(w->q, BCE_VHCI_PAUSE_INTERNAL_WQ);
-    kfree(w);
+static void bce_vhci_urb_cancel_work_free(struct bce_vhci_transfer_queue_urb_cancel_work *w)
+{
+    usb_put_urb(w->urb);
+    mempool_free(w, bce_vhci_cancel_work_pool);
+}
+
+static void bce_vhci_transfer_queue_process_cancels(struct bce_vhci_transfer_queue *q)
+{
+    unsigned long flags;
+    LIST_HEAD(cancels);
+    struct bce_vhci_transfer_queue_urb_cancel_work *w, *wt;
+
+    spin_lock_irqsave(&q->urb_lock, flags);
+    list_splice_init(&q->cancel_list, &cancels);
+    /* The URBs may have completed or moved since the cancel was requested */
+    list_for_each_entry_safe(w, wt, &cancels, list) {
+        if (bce_vhci_urb_try_remove_host_only(q, w->urb, w->status)) {
+            list_del(&w->list);
+            bce_vhci_urb_cancel_work_free(w);
+        }
+    }
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    bce_vhci_transfer_queue_giveback(q);
+    if (list_empty(&cancels))
+        return;
+
+    /* All of the remaining URBs are removed with a single pause and flush of the queue */
+    pr_debug("bce-vhci: [%02x] Cancelling URBs\n", q->endp_addr);
+    bce_vhci_transfer_queue_pause(q, BCE_VHCI_PAUSE_INTERNAL_WQ);
+    list_for_each_entry_safe(w, wt, &cancels, list) {
+        bce_vhci_urb_remove(q, w->urb, w->status);
+        list_del(&w->list);
+        bce_vhci_urb_cancel_work_free(w);
+    }
+    bce_vhci_transfer_queue_resume(q, BCE_VHCI_PAUSE_INTERNAL_WQ);
 }
 
 int bce_vhci_urb_request_cancel(struct bce_vhci_transfer_queue *q, struct urb *urb, int status)
 {
     struct bce_vhci_transfer_queue_urb_cancel_work *w;
-    struct bce_vhci_urb *vurb;
     unsigned long flags;
     int ret;
 
@@ -451,23 +857,29 @@ int bce_vhci_urb_request_cancel(struct bce_vhci_transfer_queue *q, struct urb *u
         return ret;
     }
 
-    vurb = urb->hcpriv;
     /* If the URB wasn't posted to the device yet, we can still remove it on the host without pausing the queue. */
-    if (vurb->state == BCE_VHCI_URB_INIT_PENDING) {
-        bce_vhci_urb_dequeue_unlink(q, urb, status);
+    if (bce_vhci_urb_try_remove_host_only(q, urb, status)) {
         spin_unlock_irqrestore(&q->urb_lock, flags);
-        kfree(vurb);
-        usb_hcd_giveback_urb(q->vhci->hcd, urb, status);
+        bce_vhci_transfer_queue_giveback(q);
         return 0;
     }
     spin_unlock_irqrestore(&q->urb_lock, flags);
 
-    w = kzalloc(sizeof(struct bce_vhci_transfer_queue_urb_cancel_work), GFP_KERNEL);
-    INIT_WORK(&w->ws, bce_vhci_urb_cancel_w);
-    w->q = q;
-    w->urb = urb;
+    /* URB dequeue may be called from atomic context */
+    w = mempool_alloc(bce_vhci_cancel_work_pool, GFP_ATOMIC);
+    if (!w) {
+        atomic_inc(&bce_vhci_alloc_fail_count);
+        return -ENOMEM;
+    }
+    atomic_inc(&bce_vhci_cancel_work_alloc_count);
+    /* The caller only holds a reference to the URB until we return */
+    w->urb = usb_get_urb(urb);
     w->status = status;
-    queue_work(q->vhci->tq_state_wq, &w->ws);
+    /* Cancels queued up while the work is pending are all handled with a single pause of the queue */
+    spin_lock_irqsave(&q->urb_lock, flags);
+    list_add_tail(&w->list, &q->cancel_list);
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    queue_work(q->vhci->tq_state_wq, &q->w_state);
     return 0;
 }
 
@@ -482,13 +894,13 @@ static int bce_vhci_urb_data_transfer_in(struct bce_vhci_urb *urb, unsigned long
              (u64) urb->urb->transfer_dma, urb->urb->transfer_buffer_length);
 
     /* Reserve both a message and a submission, so we don't run into issues later. */
-    reservation1 = bce_reserve_submission(urb->q->vhci->msg_asynchronous.sq, timeout);
+    reservation1 = bce_reserve_submission(urb->q->msg_queue->sq, timeout);
     if (!reservation1)
         reservation2 = bce_reserve_submission(urb->q->sq_in, timeout);
     if (reservation1 || reservation2) {
         pr_err("bce-vhci: Failed to reserve a submission for URB data transfer\n");
         if (!reservation1)
-            bce_cancel_submission_reservation(urb->q->vhci->msg_asynchronous.sq);
+            bce_cancel_submission_reservation(urb->q->msg_queue->sq);
         return -ENOMEM;
     }
 
@@ -496,17 +908,71 @@ static int bce_vhci_urb_data_transfer_in(struct bce_vhci_urb *urb, unsigned long
 
     tr_len = urb->urb->transfer_buffer_length - urb->send_offset;
 
-    spin_lock(&urb->q->vhci->msg_asynchronous_lock);
     msg.cmd = BCE_VHCI_CMD_TRANSFER_REQUEST;
     msg.status = 0;
     msg.param1 = ((urb->urb->ep->desc.bEndpointAddress & 0x8Fu) << 8) | urb->q->dev_addr;
     msg.param2 = tr_len;
-    bce_vhci_message_queue_write(&urb->q->vhci->msg_asynchronous, &msg);
-    spin_unlock(&urb->q->vhci->msg_asynchronous_lock);
+    urb->q->msg_seq = bce_vhci_message_queue_write(urb->q->msg_queue, &msg);
 
     s = bce_next_submission(urb->q->sq_in);
     bce_set_submission_single(s, urb->urb->transfer_dma + urb->send_offset, tr_len);
-    bce_submit_to_device(urb->q->sq_in);
+    bce_vhci_transfer_queue_submit_in(urb->q);
+
+    urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+    return 0;
+}
+
+static int bce_vhci_urb_isoc_transfer_in(struct bce_vhci_urb *urb, unsigned long *timeout)
+{
+    struct usb_iso_packet_descriptor *pd;
+    struct bce_vhci_message msg;
+    struct bce_qe_submission *s;
+    u32 i, cnt;
+    int status = 0;
+
+    /* Packets which were already received are kept, everything else is (re)posted */
+    urb->iso_send_packet = urb->iso_receive_packet;
+    cnt = urb->urb->number_of_packets - urb->iso_send_packet;
+
+    /* Reserve all the messages and submissions up-front, so we never post only a part of the URB */
+    for (i = 0; i < cnt; i++) {
+        if ((status = bce_reserve_submission(urb->q->msg_queue->sq, timeout)))
+            break;
+        if ((status = bce_reserve_submission(urb->q->sq_in, timeout))) {
+            bce_cancel_submission_reservation(urb->q->msg_queue->sq);
+            break;
+        }
+    }
+    if (status) {
+        pr_err("bce-vhci: Failed to reserve submissions for isochronous URB (%u packets)\n", cnt);
+        while (i--) {
+            bce_cancel_submission_reservation(urb->q->msg_queue->sq);
+            bce_cancel_submission_reservation(urb->q->sq_in);
+        }
+        return -ENOMEM;
+    }
+
+    pr_debug("bce-vhci: [%02x] Isochronous DMA from device %llx, %u packets\n", urb->q->endp_addr,
+             (u64) urb->urb->transfer_dma, cnt);
+
+    msg.cmd = BCE_VHCI_CMD_TRANSFER_REQUEST;
+    msg.status = 0;
+    msg.param1 = ((urb->urb->ep->desc.bEndpointAddress & 0x8Fu) << 8) | urb->q->dev_addr;
+    bce_vhci_transfer_queue_plug(urb->q);
+    for (i = urb->iso_send_packet; i < urb->urb->number_of_packets; i++) {
+        pd = &urb->urb->iso_frame_desc[i];
+        pd->actual_length = 0;
+        pd->status = -EXDEV;
+
+        msg.param2 = pd->length;
+        urb->q->msg_seq = bce_vhci_message_queue_write(urb->q->msg_queue, &msg);
+
+        s = bce_next_submission(urb->q->sq_in);
+        bce_set_submission_single(s, urb->urb->transfer_dma + pd->offset, pd->length);
+    }
+    bce_vhci_transfer_queue_submit_in(urb->q);
+    bce_vhci_transfer_queue_unplug(urb->q);
+    urb->iso_send_packet = urb->urb->number_of_packets;
 
     urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
     return 0;
@@ -514,6 +980,14 @@ static int bce_vhci_urb_data_transfer_in(struct bce_vhci_urb *urb, unsigned long
 
 static int bce_vhci_urb_data_start(struct bce_vhci_urb *urb, unsigned long *timeout)
 {
+    if (urb->is_isoc) {
+        urb->iso_send_packet = urb->iso_receive_packet = 0;
+        if (urb->dir == DMA_TO_DEVICE) {
+            urb->state = BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST;
+            return 0;
+        }
+        return bce_vhci_urb_isoc_transfer_in(urb, timeout);
+    }
     if (urb->dir == DMA_TO_DEVICE) {
         if (urb->urb->transfer_buffer_length > 0)
             urb->state = BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST;
@@ -529,9 +1003,10 @@ static int bce_vhci_urb_send_out_data(struct bce_vhci_urb *urb, dma_addr_t addr,
 {
     struct bce_qe_submission *s;
     unsigned long timeout = 0;
+    /* The queue is full of chunks still in flight; the request is retried once one of them completes */
     if (bce_reserve_submission(urb->q->sq_out, &timeout)) {
-        pr_err("bce-vhci: Failed to reserve a submission for URB data transfer\n");
-        return -EPIPE;
+        pr_debug("bce-vhci: [%02x] No space for URB data transfer, deferring\n", urb->q->endp_addr);
+        return -EAGAIN;
     }
 
     pr_debug("bce-vhci: [%02x] DMA to device %llx %lx\n", urb->q->endp_addr, (u64) addr, size);
@@ -542,17 +1017,44 @@ static int bce_vhci_urb_send_out_data(struct bce_vhci_urb *urb, dma_addr_t addr,
     return 0;
 }
 
+static int bce_vhci_urb_isoc_update(struct bce_vhci_urb *urb, struct bce_vhci_message *msg)
+{
+    struct usb_iso_packet_descriptor *pd;
+    int status;
+    if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST && msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST) {
+        pd = &urb->urb->iso_frame_desc[urb->iso_send_packet];
+        pd->actual_length = 0;
+        pd->status = -EXDEV;
+        if ((status = bce_vhci_urb_send_out_data(urb, urb->urb->transfer_dma + pd->offset,
+                min(pd->length, (u32) msg->param2))))
+            return status;
+        if (++urb->iso_send_packet == urb->urb->number_of_packets)
+            urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+        return 0;
+    }
+
+    if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST && urb->q->sq_out != NULL)
+        return -EAGAIN;
+    pr_err("bce-vhci: [%02x] Isochronous URB unexpected message (state = %x, msg: %x %x %x %llx)\n",
+           urb->q->endp_addr, urb->state, msg->cmd, msg->status, msg->param1, msg->param2);
+    return -EAGAIN;
+}
+
 static int bce_vhci_urb_data_update(struct bce_vhci_urb *urb, struct bce_vhci_message *msg)
 {
     u32 tr_len;
     int status;
+    if (urb->is_isoc)
+        return bce_vhci_urb_isoc_update(urb, msg);
     if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST) {
         if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST) {
             tr_len = min(urb->urb->transfer_buffer_length - urb->send_offset, (u32) msg->param2);
             if ((status = bce_vhci_urb_send_out_data(urb, urb->urb->transfer_dma + urb->send_offset, tr_len)))
                 return status;
             urb->send_offset += tr_len;
-            urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
+            /* Keep accepting requests for the following chunks while the previous ones are still in flight */
+            if (urb->send_offset >= urb->urb->transfer_buffer_length)
+                urb->state = BCE_VHCI_URB_WAITING_FOR_COMPLETION;
             return 0;
         }
     }
@@ -566,9 +1068,38 @@ static int bce_vhci_urb_data_update(struct bce_vhci_urb *urb, struct bce_vhci_me
     return -EAGAIN;
 }
 
+static int bce_vhci_urb_isoc_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+{
+    struct usb_iso_packet_descriptor *pd;
+    if (urb->iso_receive_packet >= urb->iso_send_packet) {
+        pr_err("bce-vhci: [%02x] Isochronous URB unexpected completion\n", urb->q->endp_addr);
+        return 0;
+    }
+    pd = &urb->urb->iso_frame_desc[urb->iso_receive_packet++];
+    pd->actual_length = (unsigned int) min_t(u64, c->data_size, pd->length);
+    if (c->status == BCE_COMPLETION_SUCCESS) {
+        pd->status = 0;
+    } else {
+        pd->status = (c->status == BCE_COMPLETION_OVERRUN || c->status == BCE_COMPLETION_NO_SPACE) ?
+                -EOVERFLOW : -EPROTO;
+        ++urb->urb->error_count;
+    }
+    urb->urb->actual_length += pd->actual_length;
+
+    if (urb->iso_receive_packet == urb->urb->number_of_packets) {
+        urb->state = BCE_VHCI_URB_DATA_TRANSFER_COMPLETE;
+        bce_vhci_urb_complete(urb, 0);
+        return -ENOENT;
+    }
+    return 0;
+}
+
 static int bce_vhci_urb_data_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
 {
-    if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION) {
+    if (urb->is_isoc)
+        return bce_vhci_urb_isoc_transfer_completion(urb, c);
+    if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION ||
+        (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST && urb->receive_offset < urb->send_offset)) {
         urb->receive_offset += c->data_size;
         if (urb->dir == DMA_FROM_DEVICE || urb->receive_offset >= urb->urb->transfer_buffer_length) {
             urb->urb->actual_length = (u32) urb->receive_offset;
@@ -588,7 +1119,8 @@ static int bce_vhci_urb_data_transfer_completion(struct bce_vhci_urb *urb, struc
 static int bce_vhci_urb_control_check_status(struct bce_vhci_urb *urb)
 {
     struct bce_vhci_transfer_queue *q = urb->q;
-    if (urb->received_status == 0)
+    /* The setup completion must be consumed before the URB goes away, or it would be matched to the next one */
+    if (urb->received_status == 0 || urb->setup_pending)
         return 0;
     if (urb->state == BCE_VHCI_URB_DATA_TRANSFER_COMPLETE ||
         (urb->received_status != BCE_VHCI_SUCCESS && urb->state != BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_REQUEST &&
@@ -612,6 +1144,7 @@ static int bce_vhci_urb_control_check_status(struct bce_vhci_urb *urb)
 static int bce_vhci_urb_control_update(struct bce_vhci_urb *urb, struct bce_vhci_message *msg)
 {
     int status;
+    unsigned long timeout;
     if (msg->cmd == BCE_VHCI_CMD_CONTROL_TRANSFER_STATUS) {
         urb->received_status = msg->status;
         return bce_vhci_urb_control_check_status(urb);
@@ -619,12 +1152,19 @@ static int bce_vhci_urb_control_update(struct bce_vhci_urb *urb, struct bce_vhci
 
     if (urb->state == BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_REQUEST) {
         if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST) {
-            if (bce_vhci_urb_send_out_data(urb, urb->urb->setup_dma, sizeof(struct usb_ctrlrequest))) {
+            if ((status = bce_vhci_urb_send_out_data(urb, urb->urb->setup_dma, sizeof(struct usb_ctrlrequest)))) {
+                if (status == -EAGAIN)
+                    return status;
                 pr_err("bce-vhci: [%02x] Failed to start URB setup transfer\n", urb->q->endp_addr);
                 return 0; /* TODO: fail the URB? */
             }
             urb->state = BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_COMPLETION;
             pr_debug("bce-vhci: [%02x] Sent setup %llx\n", urb->q->endp_addr, urb->urb->setup_dma);
+            /* Start the data stage right behind the setup packet instead of waiting for its completion;
+             * if there is no space for it right now, it is started once the setup completes */
+            timeout = 0;
+            if (!bce_vhci_urb_data_start(urb, &timeout))
+                urb->setup_pending = true;
             return 0;
         }
     } else if (urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST ||
@@ -642,11 +1182,21 @@ static int bce_vhci_urb_control_update(struct bce_vhci_urb *urb, struct bce_vhci
     return -EAGAIN;
 }
 
-static int bce_vhci_urb_control_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+static int bce_vhci_urb_control_transfer_completion(struct bce_vhci_urb *urb, struct bce_queue_sq *sq,
+        struct bce_sq_completion_data *c)
 {
     int status;
     unsigned long timeout;
 
+    /* OUT data is queued behind the setup packet, so the first OUT completion is always the setup one */
+    if (urb->setup_pending && sq == urb->q->sq_out) {
+        if (c->data_size != sizeof(struct usb_ctrlrequest))
+            pr_err("bce-vhci: [%02x] transfer complete data size mistmatch for usb_ctrlrequest (%llx instead of %lx)\n",
+                   urb->q->endp_addr, c->data_size, sizeof(struct usb_ctrlrequest));
+        urb->setup_pending = false;
+        return bce_vhci_urb_control_check_status(urb);
+    }
+
     if (urb->state == BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_COMPLETION) {
         if (c->data_size != sizeof(struct usb_ctrlrequest))
             pr_err("bce-vhci: [%02x] transfer complete data size mistmatch for usb_ctrlrequest (%llx instead of %lx)\n",
@@ -674,16 +1224,20 @@ static int bce_vhci_urb_update(struct bce_vhci_urb *urb, struct bce_vhci_message
 {
     if (urb->state == BCE_VHCI_URB_INIT_PENDING)
         return -EAGAIN;
+    /* Don't post more OUT data while the queue is being paused */
+    if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST && !urb->q->active)
+        return -EAGAIN;
     if (urb->is_control)
         return bce_vhci_urb_control_update(urb, msg);
     else
         return bce_vhci_urb_data_update(urb, msg);
 }
 
-static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_sq_completion_data *c)
+static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce_queue_sq *sq,
+        struct bce_sq_completion_data *c)
 {
     if (urb->is_control)
-        return bce_vhci_urb_control_transfer_completion(urb, c);
+        return bce_vhci_urb_control_transfer_completion(urb, sq, c);
     else
         return bce_vhci_urb_data_transfer_completion(urb, c);
 }
@@ -691,9 +1245,59 @@ static int bce_vhci_urb_transfer_completion(struct bce_vhci_urb *urb, struct bce
 static void bce_vhci_urb_resume(struct bce_vhci_urb *urb)
 {
     int status = 0;
-    if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION) {
+    if (urb->is_isoc && urb->dir == DMA_FROM_DEVICE) {
+        if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION)
+            status = bce_vhci_urb_isoc_transfer_in(urb, NULL);
+    } else if (urb->is_isoc) {
+        /* The packets that were flushed need to be requested again by the firmware */
+        urb->iso_send_packet = urb->iso_receive_packet;
+        urb->state = BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST;
+    } else if (urb->state == BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_COMPLETION || urb->setup_pending) {
+        /* The setup packet was flushed, together with anything of the data stage posted behind it */
+        urb->setup_pending = false;
+        urb->send_offset = urb->receive_offset = 0;
+        urb->state = BCE_VHCI_URB_CONTROL_WAITING_FOR_SETUP_REQUEST;
+    } else if ((urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION ||
+                urb->state == BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST) && urb->dir == DMA_TO_DEVICE) {
+        /* Only the data which was not confirmed yet is requested again */
+        urb->send_offset = urb->receive_offset;
+        urb->state = BCE_VHCI_URB_WAITING_FOR_TRANSFER_REQUEST;
+    } else if (urb->state == BCE_VHCI_URB_WAITING_FOR_COMPLETION) {
         status = bce_vhci_urb_data_transfer_in(urb, NULL);
     }
     if (status)
         bce_vhci_urb_complete(urb, status);
+}
+
+int __init bce_vhci_transfer_module_init(struct dentry *debugfs_dir)
+{
+    bce_vhci_urb_cache = KMEM_CACHE(bce_vhci_urb, 0);
+    bce_vhci_cancel_work_cache = KMEM_CACHE(bce_vhci_transfer_queue_urb_cancel_work, 0);
+    if (!bce_vhci_urb_cache || !bce_vhci_cancel_work_cache)
+        goto fail;
+    bce_vhci_urb_pool = mempool_create_slab_pool(BCE_VHCI_URB_POOL_MIN_COUNT, bce_vhci_urb_cache);
+    bce_vhci_cancel_work_pool = mempool_create_slab_pool(BCE_VHCI_CANCEL_WORK_POOL_MIN_COUNT,
+            bce_vhci_cancel_work_cache);
+    if (!bce_vhci_urb_pool || !bce_vhci_cancel_work_pool)
+        goto fail;
+
+    debugfs_create_atomic_t("urb_allocations", 0444, debugfs_dir, &bce_vhci_urb_alloc_count);
+    debugfs_create_atomic_t("urbs_active", 0444, debugfs_dir, &bce_vhci_urb_active_count);
+    debugfs_create_atomic_t("cancel_work_allocations", 0444, debugfs_dir, &bce_vhci_cancel_work_alloc_count);
+    debugfs_create_atomic_t("allocation_failures", 0444, debugfs_dir, &bce_vhci_alloc_fail_count);
+    return 0;
+
+fail:
+    bce_vhci_transfer_module_exit();
+    return -ENOMEM;
+}
+
+void bce_vhci_transfer_module_exit(void)
+{
+    mempool_destroy(bce_vhci_cancel_work_pool);
+    mempool_destroy(bce_vhci_urb_pool);
+    kmem_cache_destroy(bce_vhci_cancel_work_cache);
+    kmem_cache_destroy(bce_vhci_urb_cache);
+    bce_vhci_cancel_work_pool = bce_vhci_urb_pool = NULL;
+    bce_vhci_cancel_work_cache = bce_vhci_urb_cache = NULL;
 }
\ No newline at end of file
@@ -6,10 +6,18 @@
 #include "command.h"
 #include "../queue.h"
 
-struct bce_vhci_list_message {
-    struct list_head list;
-    struct bce_vhci_message msg;
-};
+/* Isochronous URBs post a submission per packet, so their queues keep the full size */
+#define BCE_VHCI_ISOC_SQ_EL_COUNT 0x100
+/* All the packets of an isochronous IN URB are posted at once, so the active URBs of an endpoint must fit in it */
+#define BCE_VHCI_ISOC_MAX_PACKETS ((BCE_VHCI_ISOC_SQ_EL_COUNT - 1) / BCE_VHCI_ISOC_MAX_ACTIVE_URBS)
+#define BCE_VHCI_MIN_SQ_EL_COUNT 8
+
+/* How long the firmware gets to consume the OUT data which was already posted when an endpoint is paused */
+#define BCE_VHCI_OUT_DRAIN_TIMEOUT msecs_to_jiffies(500)
+
+/* Minimum amount of firmware events that can be deferred per transfer queue; the ring is a power of two */
+#define BCE_VHCI_TRANSFER_QUEUE_MIN_DEFERRED_EVENTS 4
+
 enum bce_vhci_pause_source {
     BCE_VHCI_PAUSE_INTERNAL_WQ = 1,
     BCE_VHCI_PAUSE_FIRMWARE = 2,
@@ -25,15 +33,43 @@ struct bce_vhci_transfer_queue {
     u32 paused_by;
     bce_vhci_device_t dev_addr;
     u8 endp_addr;
+    enum dma_data_direction dir;
+    /* The firmware endpoint exists; cleared while the device is being reset. Written with both pause_lock and
+     * urb_lock held, so either of them is enough to read it */
+    bool registered;
+    /* An ENDPOINT_CREATE command was submitted and its reply not yet collected, see
+     * bce_vhci_transfer_queue_wait_registered */
+    bool create_pending;
+    struct bce_vhci_command_queue_completion create_c;
+    struct bce_vhci_message create_res;
     struct bce_queue_cq *cq;
+    bool owns_cq;
     struct bce_queue_sq *sq_in;
     struct bce_queue_sq *sq_out;
-    struct list_head evq;
+    /* Transfer requests go to the host message queue matching the endpoint type */
+    struct bce_vhci_message_queue *msg_queue;
+    /* While plugged (protected by urb_lock), the sq_in doorbell is only rung once by the final unplug */
+    u32 plug_depth;
+    bool sq_in_pending;
+    /* Sequence number of the last transfer request message, see bce_vhci_transfer_queue_ring_in */
+    u32 msg_seq;
+    struct bce_vhci_message *evq;
+    u32 evq_size, evq_head, evq_count;
+    u32 evq_overflow_count;
     struct spinlock urb_lock;
     struct mutex pause_lock;
     struct list_head giveback_urb_list;
+    struct list_head cancel_list;
+    wait_queue_head_t out_drain_wq;
 
-    struct work_struct w_reset;
+    /* All state changes of the endpoint (firmware pause requests, reset, cancellation) run from this single work
+     * item, so they are ordered per endpoint while different endpoints can be processed concurrently */
+    struct work_struct w_state;
+    /* The state last requested by the firmware with ENDPOINT_REQUEST_STATE, applied by w_state */
+    bool fw_pause;
+    /* Lets bus suspend/resume pause or resume all endpoints at the same time */
+    struct work_struct w_bus;
+    bool bus_pause;
 };
 enum bce_vhci_urb_state {
     BCE_VHCI_URB_INIT_PENDING,
@@ -51,28 +87,48 @@ struct bce_vhci_urb {
     struct bce_vhci_transfer_queue *q;
     enum dma_data_direction dir;
     bool is_control;
+    bool is_isoc;
     enum bce_vhci_urb_state state;
     int received_status;
+    /* The data stage of a control URB was started before the completion of its setup packet was received */
+    bool setup_pending;
+    /* send_offset is how much data was posted, receive_offset how much of it was confirmed by a completion;
+     * after a queue flush OUT transfers restart from receive_offset */
     u32 send_offset;
     u32 receive_offset;
+    /* Isochronous URBs are transferred one packet at a time; these track the next iso_frame_desc to send/receive */
+    u32 iso_send_packet;
+    u32 iso_receive_packet;
 };
 
 struct bce_vhci_transfer_queue_urb_cancel_work {
-    struct work_struct ws;
-    struct bce_vhci_transfer_queue *q;
+    struct list_head list;
     struct urb *urb;
     int status;
 };
 
-void bce_vhci_create_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q,
-        struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir);
+struct dentry;
+
+int __init bce_vhci_transfer_module_init(struct dentry *debugfs_dir);
+void bce_vhci_transfer_module_exit(void);
+
+struct bce_vhci_transfer_queue *bce_vhci_create_transfer_queue(struct bce_vhci *vhci,
+        struct usb_host_endpoint *endp, bce_vhci_device_t dev_addr, enum dma_data_direction dir,
+        struct bce_queue_cq *shared_cq);
 void bce_vhci_destroy_transfer_queue(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q);
+int bce_vhci_transfer_queue_wait_registered(struct bce_vhci_transfer_queue *q);
+void bce_vhci_transfer_queue_unbind(struct bce_vhci_transfer_queue *q);
+int bce_vhci_transfer_queue_rebind(struct bce_vhci_transfer_queue *q, bce_vhci_device_t dev_addr);
+void bce_vhci_transfer_queue_abort(struct bce_vhci_transfer_queue *q, int status);
 void bce_vhci_transfer_queue_event(struct bce_vhci_transfer_queue *q, struct bce_vhci_message *msg);
 int bce_vhci_transfer_queue_pause(struct bce_vhci_transfer_queue *q, enum bce_vhci_pause_source src);
 int bce_vhci_transfer_queue_resume(struct bce_vhci_transfer_queue *q, enum bce_vhci_pause_source src);
 void bce_vhci_transfer_queue_request_reset(struct bce_vhci_transfer_queue *q);
+void bce_vhci_transfer_queue_request_firmware_pause(struct bce_vhci_transfer_queue *q, bool pause);
+void bce_vhci_transfer_queue_bus_pause_async(struct bce_vhci_transfer_queue *q, bool pause);
+void bce_vhci_transfer_queue_bus_wait(struct bce_vhci_transfer_queue *q);
 
-int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb);
+int bce_vhci_urb_create(struct bce_vhci_transfer_queue *q, struct urb *urb, gfp_t mem_flags);
 int bce_vhci_urb_request_cancel(struct bce_vhci_transfer_queue *q, struct urb *urb, int status);
 
 #endif //BCEDRIVER_TRANSFER_H
@@ -4,9 +4,12 @@
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/rcupdate.h>
 
 static dev_t bce_vhci_chrdev;
 static struct class *bce_vhci_class;
+static struct dentry *bce_vhci_debugfs_dir;
 static const struct hc_driver bce_vhci_driver;
 static u16 bce_vhci_port_mask = U16_MAX;
 
@@ -16,12 +19,22 @@ static int bce_vhci_create_message_queues(struct bce_vhci *vhci);
 static void bce_vhci_destroy_message_queues(struct bce_vhci *vhci);
 static void bce_vhci_handle_firmware_events_w(struct work_struct *ws);
 static void bce_vhci_firmware_event_completion(struct bce_queue_sq *sq);
+static void bce_vhci_desc_cache_invalidate(struct bce_vhci *vhci, bce_vhci_port_t port, bool forget);
+
+static void bce_vhci_event_queue_debugfs(struct bce_vhci *vhci, struct bce_vhci_event_queue *q, const char *name)
+{
+    struct dentry *dir = debugfs_create_dir(name, vhci->debugfs_dir);
+    debugfs_create_u32("depth", 0444, dir, &q->depth);
+    debugfs_create_u32("starved", 0444, dir, &q->starved_count);
+}
 
 int bce_vhci_create(struct bce_device *dev, struct bce_vhci *vhci)
 {
     int status;
 
     spin_lock_init(&vhci->hcd_spinlock);
+    spin_lock_init(&vhci->port_status_lock);
+    spin_lock_init(&vhci->desc_cache_lock);
 
     vhci->dev = dev;
 
@@ -37,7 +50,18 @@ int bce_vhci_create(struct bce_device *dev, struct bce_vhci *vhci)
     if ((status = bce_vhci_create_event_queues(vhci)))
         goto fail_eq;
 
-    vhci->tq_state_wq = alloc_ordered_workqueue("bce-vhci-tq-state", 0);
+    /* Endpoints serialize their own state changes (see bce_vhci_transfer_queue_state_w), so they can run
+     * concurrently. Firmware events must not wait behind a slow endpoint pause, so they get their own queue. */
+    vhci->tq_state_wq = alloc_workqueue("bce-vhci-tq-state", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!vhci->tq_state_wq) {
+        status = -ENOMEM;
+        goto fail_tq_wq;
+    }
+    vhci->fw_event_wq = alloc_ordered_workqueue("bce-vhci-fw-events", WQ_HIGHPRI | WQ_MEM_RECLAIM);
+    if (!vhci->fw_event_wq) {
+        status = -ENOMEM;
+        goto fail_fw_wq;
+    }
     INIT_WORK(&vhci->w_fw_events, bce_vhci_handle_firmware_events_w);
 
     vhci->hcd = usb_create_hcd(&bce_vhci_driver, vhci->vdev, "bce-vhci");
@@ -48,13 +72,31 @@ int bce_vhci_create(struct bce_device *dev, struct bce_vhci *vhci)
     vhci->hcd->self.sysdev = &dev->pci->dev;
     *((struct bce_vhci **) vhci->hcd->hcd_priv) = vhci;
     vhci->hcd->speed = HCD_USB2;
+    /* Port changes are reported by the firmware, see bce_vhci_handle_system_event */
+    vhci->hcd->uses_new_polling = 1;
 
     if ((status = usb_add_hcd(vhci->hcd, 0, 0)))
         goto fail_hcd;
 
+    vhci->debugfs_dir = debugfs_create_dir(dev_name(vhci->vdev), bce_vhci_debugfs_dir);
+    debugfs_create_atomic_t("msg_isochronous_contended", 0444, vhci->debugfs_dir,
+            &vhci->msg_isochronous.publish_contended);
+    debugfs_create_atomic_t("msg_interrupt_contended", 0444, vhci->debugfs_dir,
+            &vhci->msg_interrupt.publish_contended);
+    debugfs_create_atomic_t("msg_asynchronous_contended", 0444, vhci->debugfs_dir,
+            &vhci->msg_asynchronous.publish_contended);
+    bce_vhci_event_queue_debugfs(vhci, &vhci->ev_commands, "ev_commands");
+    bce_vhci_event_queue_debugfs(vhci, &vhci->ev_system, "ev_system");
+    bce_vhci_event_queue_debugfs(vhci, &vhci->ev_isochronous, "ev_isochronous");
+    bce_vhci_event_queue_debugfs(vhci, &vhci->ev_interrupt, "ev_interrupt");
+    bce_vhci_event_queue_debugfs(vhci, &vhci->ev_asynchronous, "ev_asynchronous");
     return 0;
 
 fail_hcd:
+    destroy_workqueue(vhci->fw_event_wq);
+fail_fw_wq:
+    destroy_workqueue(vhci->tq_state_wq);
+fail_tq_wq:
     bce_vhci_destroy_event_queues(vhci);
 fail_eq:
     bce_vhci_destroy_message_queues(vhci);
@@ -68,8 +110,14 @@ fail_dev:
 
 void bce_vhci_destroy(struct bce_vhci *vhci)
 {
+    int i;
+    debugfs_remove_recursive(vhci->debugfs_dir);
     usb_remove_hcd(vhci->hcd);
+    for (i = 0; i < 16; i++)
+        bce_vhci_desc_cache_invalidate(vhci, (bce_vhci_port_t) i, true);
     bce_vhci_destroy_event_queues(vhci);
+    destroy_workqueue(vhci->fw_event_wq);
+    destroy_workqueue(vhci->tq_state_wq);
     bce_vhci_destroy_message_queues(vhci);
     device_destroy(bce_vhci_class, vhci->vdevt);
 }
@@ -97,6 +145,9 @@ int bce_vhci_start(struct usb_hcd *hcd)
         port_mask >>= 1;
     }
     vhci->port_count = port_no;
+    vhci->port_status_valid = 0;
+    vhci->frame_base = ktime_get();
+    clear_bit(HCD_FLAG_POLL_RH, &hcd->flags);
     return 0;
 }
 
@@ -106,11 +157,95 @@ void bce_vhci_stop(struct usb_hcd *hcd)
     bce_vhci_cmd_controller_disable(&vhci->cq);
 }
 
-static int bce_vhci_hub_status_data(struct usb_hcd *hcd, char *buf)
+static void bce_vhci_port_status_set(struct bce_vhci *vhci, bce_vhci_port_t port, u32 port_status)
 {
+    unsigned long flags;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    vhci->port_status[port] = port_status;
+    vhci->port_status_valid |= BIT(port);
+    ++vhci->port_status_seq[port];
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+}
+
+static void bce_vhci_port_status_invalidate(struct bce_vhci *vhci, bce_vhci_port_t port)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    vhci->port_status_valid &= ~BIT(port);
+    ++vhci->port_status_seq[port];
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+}
+
+static void bce_vhci_port_status_invalidate_all(struct bce_vhci *vhci)
+{
+    unsigned long flags;
+    int i;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    vhci->port_status_valid = 0;
+    for (i = 0; i < 16; i++)
+        ++vhci->port_status_seq[i];
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+}
+
+/* Asks the firmware for the port status, clearing the given change bits */
+static int bce_vhci_port_status_query(struct bce_vhci *vhci, bce_vhci_port_t port, u32 clear, u32 *port_status)
+{
+    unsigned long flags;
+    u32 seq;
+    int status;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    seq = vhci->port_status_seq[port];
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+
+    if ((status = bce_vhci_cmd_port_status(&vhci->cq, port, clear, port_status)))
+        return status;
+    /* Only cache the reply if the status didn't change while we were waiting for it; if a newer one arrived
+     * meanwhile, that one is returned instead */
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    if (vhci->port_status_seq[port] == seq) {
+        vhci->port_status[port] = *port_status;
+        vhci->port_status_valid |= BIT(port);
+        ++vhci->port_status_seq[port];
+    } else if (vhci->port_status_valid & BIT(port)) {
+        *port_status = vhci->port_status[port];
+    }
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
     return 0;
 }
 
+/* Returns the cached port status, only asking the firmware if we have not seen the current one yet */
+static int bce_vhci_port_status_get(struct bce_vhci *vhci, bce_vhci_port_t port, u32 *port_status)
+{
+    unsigned long flags;
+    bool valid;
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    valid = (vhci->port_status_valid & BIT(port)) != 0;
+    *port_status = vhci->port_status[port];
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+    if (valid)
+        return 0;
+    return bce_vhci_port_status_query(vhci, port, 0, port_status);
+}
+
+static int bce_vhci_hub_status_data(struct usb_hcd *hcd, char *buf)
+{
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    unsigned long flags;
+    int i, len = DIV_ROUND_UP(vhci->port_count + 1, 8);
+    bool changed = false;
+
+    memset(buf, 0, len);
+    spin_lock_irqsave(&vhci->port_status_lock, flags);
+    for (i = 1; i <= vhci->port_count && i < 16; i++) {
+        if ((vhci->port_status_valid & BIT(i)) && (vhci->port_status[i] & BCE_VHCI_PORT_STATUS_C_CONNECTION)) {
+            buf[i / 8] |= BIT(i % 8);
+            changed = true;
+        }
+    }
+    spin_unlock_irqrestore(&vhci->port_status_lock, flags);
+    return changed ? len : 0;
+}
+
 static int bce_vhci_reset_device(struct bce_vhci *vhci, int index, u16 timeout);
 
 static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u16 wIndex, char *buf, u16 wLength)
@@ -146,10 +281,10 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
         if (vhci->port_power_mask & BIT(wIndex))
             ps->wPortStatus |= USB_PORT_STAT_POWER;
 
-        if (!(bce_vhci_port_mask & BIT(wIndex)))
+        if (!(bce_vhci_port_mask & BIT(wIndex)) || wIndex >= 16)
             return 0;
 
-        if ((status = bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, 0, &port_status)))
+        if ((status = bce_vhci_port_status_get(vhci, (u8) wIndex, &port_status)))
             return status;
 
         if (port_status & 16)
@@ -163,12 +298,14 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
         if (port_status & 0x60)
             ps->wPortStatus |= USB_PORT_STAT_SUSPEND;
 
-        if (port_status & 0x40000)
+        if (port_status & BCE_VHCI_PORT_STATUS_C_CONNECTION)
             ps->wPortChange |= USB_PORT_STAT_C_CONNECTION;
 
-        pr_info("bce-vhci: Translated status %x to %x:%x\n", port_status, ps->wPortStatus, ps->wPortChange);
+        pr_debug("bce-vhci: Translated status %x to %x:%x\n", port_status, ps->wPortStatus, ps->wPortChange);
         return 0;
     } else if (typeReq == SetPortFeature) {
+        if (wIndex < 16)
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
         if (wValue == USB_PORT_FEAT_POWER) {
             status = bce_vhci_cmd_port_power_on(&vhci->cq, (u8) wIndex);
             /* As far as I am aware, power status is not part of the port status so store it separately */
@@ -185,6 +322,8 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
             return bce_vhci_cmd_port_suspend(&vhci->cq, (u8) wIndex);
         }
     } else if (typeReq == ClearPortFeature) {
+        if (wIndex < 16)
+            bce_vhci_port_status_invalidate(vhci, (u8) wIndex);
         if (wValue == USB_PORT_FEAT_ENABLE)
             return bce_vhci_cmd_port_disable(&vhci->cq, (u8) wIndex);
         if (wValue == USB_PORT_FEAT_POWER) {
@@ -193,8 +332,13 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
                 vhci->port_power_mask &= ~BIT(wIndex);
             return status;
         }
-        if (wValue == USB_PORT_FEAT_C_CONNECTION)
-            return bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, 0x40000, &port_status);
+        if (wValue == USB_PORT_FEAT_C_CONNECTION) {
+            if (wIndex < 16)
+                return bce_vhci_port_status_query(vhci, (u8) wIndex, BCE_VHCI_PORT_STATUS_C_CONNECTION,
+                        &port_status);
+            return bce_vhci_cmd_port_status(&vhci->cq, (u8) wIndex, BCE_VHCI_PORT_STATUS_C_CONNECTION,
+                    &port_status);
+        }
         if (wValue == USB_PORT_FEAT_C_RESET) { /* I don't think I can transfer it in any way */
             return 0;
         }
@@ -208,6 +352,14 @@ static int bce_vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue, u1
     return -EIO;
 }
 
+/* Waits until the event handlers can no longer use a device or transfer queue which was just unpublished */
+static void bce_vhci_quiesce_events(struct bce_vhci *vhci)
+{
+    /* USB events look them up under rcu_read_lock, firmware events are handled by a single work item */
+    synchronize_rcu();
+    flush_work(&vhci->w_fw_events);
+}
+
 static int bce_vhci_enable_device(struct usb_hcd *hcd, struct usb_device *udev)
 {
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
@@ -218,21 +370,41 @@ static int bce_vhci_enable_device(struct usb_hcd *hcd, struct usb_device *udev)
     if (vhci->port_to_device[udev->portnum])
         return 0;
 
+    vdev = kzalloc(sizeof(struct bce_vhci_device), GFP_KERNEL);
+    if (!vdev)
+        return -ENOMEM;
+    vdev->cq = bce_create_cq(vhci->dev, BCE_VHCI_DEVICE_CQ_EL_COUNT);
+    if (!vdev->cq) {
+        kfree(vdev);
+        return -ENOMEM;
+    }
+
     /* We need to early address the device */
-    if (bce_vhci_cmd_device_create(&vhci->cq, udev->portnum, &devid))
+    if (bce_vhci_cmd_device_create(&vhci->cq, udev->portnum, &devid)) {
+        bce_destroy_cq(vhci->dev, vdev->cq);
+        kfree(vdev);
         return -EIO;
+    }
 
     pr_info("bce_vhci_cmd_device_create %i -> %i\n", udev->portnum, devid);
+    bce_vhci_desc_cache_invalidate(vhci, udev->portnum, false);
 
-    vdev = kzalloc(sizeof(struct bce_vhci_device), GFP_KERNEL);
-    vhci->port_to_device[udev->portnum] = devid;
-    vhci->devices[devid] = vdev;
-
-    bce_vhci_create_transfer_queue(vhci, &vdev->tq[0], &udev->ep0, devid, DMA_BIDIRECTIONAL);
-    udev->ep0.hcpriv = &vdev->tq[0];
+    vdev->tq[0] = bce_vhci_create_transfer_queue(vhci, &udev->ep0, devid, DMA_BIDIRECTIONAL, vdev->cq);
+    if (vdev->tq[0] && bce_vhci_transfer_queue_wait_registered(vdev->tq[0])) {
+        bce_vhci_destroy_transfer_queue(vhci, vdev->tq[0]);
+        vdev->tq[0] = NULL;
+    }
+    if (!vdev->tq[0]) {
+        bce_vhci_cmd_device_destroy(&vhci->cq, devid);
+        bce_destroy_cq(vhci->dev, vdev->cq);
+        kfree(vdev);
+        return -ENOMEM;
+    }
+    udev->ep0.hcpriv = vdev->tq[0];
     vdev->tq_mask |= BIT(0);
 
-    bce_vhci_cmd_endpoint_create(&vhci->cq, devid, &udev->ep0.desc);
+    vhci->port_to_device[udev->portnum] = devid;
+    rcu_assign_pointer(vhci->devices[devid], vdev);
     return 0;
 }
 
@@ -253,16 +425,22 @@ static void bce_vhci_free_device(struct usb_hcd *hcd, struct usb_device *udev)
         return;
     devid = vhci->port_to_device[udev->portnum];
     dev = vhci->devices[devid];
+    bce_vhci_desc_cache_invalidate(vhci, udev->portnum, false);
+    for (i = 0; i < 32; i++) {
+        if (dev->tq_mask & BIT(i))
+            bce_vhci_transfer_queue_pause(dev->tq[i], BCE_VHCI_PAUSE_SHUTDOWN);
+    }
+    RCU_INIT_POINTER(vhci->devices[devid], NULL);
+    vhci->port_to_device[udev->portnum] = 0;
+    bce_vhci_quiesce_events(vhci);
     for (i = 0; i < 32; i++) {
         if (dev->tq_mask & BIT(i)) {
-            bce_vhci_transfer_queue_pause(&dev->tq[i], BCE_VHCI_PAUSE_SHUTDOWN);
-            bce_vhci_cmd_endpoint_destroy(&vhci->cq, devid, (u8) i);
-            bce_vhci_destroy_transfer_queue(vhci, &dev->tq[i]);
+            bce_vhci_destroy_transfer_queue(vhci, dev->tq[i]);
+            dev->tq[i] = NULL;
         }
     }
-    vhci->devices[devid] = NULL;
-    vhci->port_to_device[udev->portnum] = 0;
     bce_vhci_cmd_device_destroy(&vhci->cq, devid);
+    bce_destroy_cq(vhci->dev, dev->cq);
     kfree(dev);
 }
 
@@ -271,83 +449,189 @@ static int bce_vhci_reset_device(struct bce_vhci *vhci, int index, u16 timeout)
     struct bce_vhci_device *dev = NULL;
     bce_vhci_device_t devid;
     int i;
-    int status;
-    enum dma_data_direction dir;
+    int status, ret;
     pr_info("bce_vhci_reset_device %i\n", index);
+    if (index < 16) {
+        bce_vhci_desc_cache_invalidate(vhci, (bce_vhci_port_t) index, false);
+        bce_vhci_port_status_invalidate(vhci, (bce_vhci_port_t) index);
+    }
 
+    /* The transfer queues are kept across the reset, they only get detached from the firmware device */
     devid = vhci->port_to_device[index];
     if (devid) {
         dev = vhci->devices[devid];
 
         for (i = 0; i < 32; i++) {
             if (dev->tq_mask & BIT(i)) {
-                bce_vhci_transfer_queue_pause(&dev->tq[i], BCE_VHCI_PAUSE_SHUTDOWN);
-                bce_vhci_cmd_endpoint_destroy(&vhci->cq, devid, (u8) i);
-                bce_vhci_destroy_transfer_queue(vhci, &dev->tq[i]);
+                bce_vhci_transfer_queue_pause(dev->tq[i], BCE_VHCI_PAUSE_SHUTDOWN);
+                bce_vhci_transfer_queue_unbind(dev->tq[i]);
             }
         }
-        vhci->devices[devid] = NULL;
-        vhci->port_to_device[devid] = 0;
+        RCU_INIT_POINTER(vhci->devices[devid], NULL);
+        vhci->port_to_device[index] = 0;
         bce_vhci_cmd_device_destroy(&vhci->cq, devid);
     }
     status = bce_vhci_cmd_port_reset(&vhci->cq, (u8) index, timeout);
+    /* Anything cached or queried while the port was being reset is stale now */
+    if (index < 16)
+        bce_vhci_port_status_invalidate(vhci, (bce_vhci_port_t) index);
 
     if (dev) {
-        if ((status = bce_vhci_cmd_device_create(&vhci->cq, index, &devid)))
-            return status;
-        vhci->devices[devid] = dev;
+        if ((status = bce_vhci_cmd_device_create(&vhci->cq, index, &devid))) {
+            pr_err("bce-vhci: Failed to recreate the device after a reset (%i)\n", status);
+            goto fail_dev;
+        }
+        rcu_assign_pointer(vhci->devices[devid], dev);
         vhci->port_to_device[index] = devid;
 
         for (i = 0; i < 32; i++) {
             if (dev->tq_mask & BIT(i)) {
-                dir = usb_endpoint_dir_in(&dev->tq[i].endp->desc) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
-                if (i == 0)
-                    dir = DMA_BIDIRECTIONAL;
-                bce_vhci_create_transfer_queue(vhci, &dev->tq[i], dev->tq[i].endp, devid, dir);
-                bce_vhci_cmd_endpoint_create(&vhci->cq, devid, &dev->tq[i].endp->desc);
+                if ((ret = bce_vhci_transfer_queue_rebind(dev->tq[i], devid))) {
+                    /* The queue stays paused, so nothing new is posted to an endpoint the firmware doesn't know */
+                    bce_vhci_transfer_queue_abort(dev->tq[i], -ENODEV);
+                    if (!status)
+                        status = ret;
+                    continue;
+                }
+                bce_vhci_transfer_queue_resume(dev->tq[i], BCE_VHCI_PAUSE_SHUTDOWN);
             }
         }
     }
 
     return status;
+
+fail_dev:
+    /* The device is gone as far as the firmware is concerned, so is everything that was queued on it */
+    bce_vhci_quiesce_events(vhci);
+    for (i = 0; i < 32; i++) {
+        if (dev->tq_mask & BIT(i)) {
+            bce_vhci_transfer_queue_abort(dev->tq[i], -ENODEV);
+            bce_vhci_destroy_transfer_queue(vhci, dev->tq[i]);
+            dev->tq[i] = NULL;
+        }
+    }
+    bce_destroy_cq(vhci->dev, dev->cq);
+    kfree(dev);
+    return status;
 }
 
+static void bce_vhci_remove_endpoint(struct bce_vhci *vhci, bce_vhci_device_t devid, u8 endp_index,
+        struct bce_vhci_transfer_queue *q);
+
+/* add_endpoint only submits the ENDPOINT_CREATE commands, so the endpoints of a configuration are created
+ * concurrently; their replies are all collected here */
 static int bce_vhci_check_bandwidth(struct usb_hcd *hcd, struct usb_device *udev)
 {
-    return 0;
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    struct bce_vhci_device *vdev = vhci->devices[vhci->port_to_device[udev->portnum]];
+    int i, status, ret = 0;
+    if (udev->bus->root_hub == udev || !vdev)
+        return 0;
+    for (i = 0; i < 32; i++) {
+        if (!(vdev->tq_added_mask & BIT(i)))
+            continue;
+        if ((status = bce_vhci_transfer_queue_wait_registered(vdev->tq[i])) && !ret)
+            ret = status;
+    }
+    /* On failure usbcore calls reset_bandwidth, which removes the new endpoints again */
+    if (!ret)
+        vdev->tq_added_mask = 0;
+    return ret;
 }
 
-static int bce_vhci_get_frame_number(struct usb_hcd *hcd)
+static void bce_vhci_reset_bandwidth(struct usb_hcd *hcd, struct usb_device *udev)
 {
-    return 0;
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    bce_vhci_device_t devid = vhci->port_to_device[udev->portnum];
+    struct bce_vhci_device *vdev = vhci->devices[devid];
+    int i;
+    if (udev->bus->root_hub == udev || !vdev)
+        return;
+    for (i = 0; i < 32; i++) {
+        if (vdev->tq_added_mask & BIT(i))
+            bce_vhci_remove_endpoint(vhci, devid, (u8) i, vdev->tq[i]);
+    }
+    vdev->tq_added_mask = 0;
 }
 
-static int bce_vhci_bus_suspend(struct usb_hcd *hcd)
+static int bce_vhci_get_frame_number(struct usb_hcd *hcd)
 {
-    int i, j;
-    int status;
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
-    pr_info("bce_vhci: suspend started\n");
+    /* The T2 does not expose its frame counter, so derive one from the time the controller was started */
+    return (int) (ktime_ms_delta(ktime_get(), vhci->frame_base) & BCE_VHCI_FRAME_NUMBER_MASK);
+}
 
-    pr_info("bce_vhci: suspend endpoints\n");
+/* Pauses or resumes the endpoints of all devices concurrently and waits until all of them are done */
+static void bce_vhci_bus_pause_endpoints(struct bce_vhci *vhci, bool pause)
+{
+    int i, j;
+    struct bce_vhci_device *dev;
     for (i = 0; i < 16; i++) {
         if (!vhci->port_to_device[i])
             continue;
+        dev = vhci->devices[vhci->port_to_device[i]];
         for (j = 0; j < 32; j++) {
-            if (!(vhci->devices[vhci->port_to_device[i]]->tq_mask & BIT(j)))
-                continue;
-            bce_vhci_transfer_queue_pause(&vhci->devices[vhci->port_to_device[i]]->tq[j],
-                    BCE_VHCI_PAUSE_SUSPEND);
+            if (dev->tq_mask & BIT(j))
+                bce_vhci_transfer_queue_bus_pause_async(dev->tq[j], pause);
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        if (!vhci->port_to_device[i])
+            continue;
+        dev = vhci->devices[vhci->port_to_device[i]];
+        for (j = 0; j < 32; j++) {
+            if (dev->tq_mask & BIT(j))
+                bce_vhci_transfer_queue_bus_wait(dev->tq[j]);
         }
     }
+}
+
+struct bce_vhci_port_commands {
+    struct bce_vhci_command_queue_completion c[16];
+    struct bce_vhci_message res[16];
+};
+
+/* Sends a port command to every port with a device at once, then waits for all of the replies */
+static void bce_vhci_bus_port_command(struct bce_vhci *vhci, u16 cmd)
+{
+    int i;
+    u16 submitted = 0;
+    struct bce_vhci_message req, res;
+    struct bce_vhci_port_commands *pc = kzalloc(sizeof(struct bce_vhci_port_commands), GFP_KERNEL);
 
-    pr_info("bce_vhci: suspend ports\n");
     for (i = 0; i < 16; i++) {
         if (!vhci->port_to_device[i])
             continue;
-        bce_vhci_cmd_port_suspend(&vhci->cq, i);
+        req.cmd = cmd;
+        req.status = 0;
+        req.param1 = (u32) i;
+        req.param2 = 0;
+        if (!pc) {
+            bce_vhci_command_queue_execute(&vhci->cq, &req, &res, BCE_VHCI_CMD_TIMEOUT_LONG);
+            continue;
+        }
+        if (!bce_vhci_command_queue_submit(&vhci->cq, &pc->c[i], &req, &pc->res[i], BCE_VHCI_CMD_TIMEOUT_LONG))
+            submitted |= BIT(i);
     }
-    pr_info("bce_vhci: suspend controller\n");
+    for (i = 0; i < 16; i++) {
+        if (submitted & BIT(i))
+            bce_vhci_command_queue_wait(&vhci->cq, &pc->c[i], BCE_VHCI_CMD_TIMEOUT_LONG);
+    }
+    kfree(pc);
+}
+
+static int bce_vhci_bus_suspend(struct usb_hcd *hcd)
+{
+    int status;
+    struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
+    ktime_t start = ktime_get(), t_endpoints, t_ports;
+
+    bce_vhci_bus_pause_endpoints(vhci, true);
+    t_endpoints = ktime_get();
+
+    bce_vhci_bus_port_command(vhci, BCE_VHCI_CMD_PORT_SUSPEND);
+    t_ports = ktime_get();
+
     if ((status = bce_vhci_cmd_controller_pause(&vhci->cq)))
         return status;
 
@@ -356,16 +640,17 @@ static int bce_vhci_bus_suspend(struct usb_hcd *hcd)
     bce_vhci_event_queue_pause(&vhci->ev_isochronous);
     bce_vhci_event_queue_pause(&vhci->ev_interrupt);
     bce_vhci_event_queue_pause(&vhci->ev_asynchronous);
-    pr_info("bce_vhci: suspend done\n");
+    pr_info("bce_vhci: suspend done (endpoints %lld us, ports %lld us, controller %lld us)\n",
+            ktime_us_delta(t_endpoints, start), ktime_us_delta(t_ports, t_endpoints),
+            ktime_us_delta(ktime_get(), t_ports));
     return 0;
 }
 
 static int bce_vhci_bus_resume(struct usb_hcd *hcd)
 {
-    int i, j;
     int status;
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
-    pr_info("bce_vhci: resume started\n");
+    ktime_t start = ktime_get(), t_controller, t_ports;
 
     bce_vhci_event_queue_resume(&vhci->ev_system);
     bce_vhci_event_queue_resume(&vhci->ev_isochronous);
@@ -373,39 +658,181 @@ static int bce_vhci_bus_resume(struct usb_hcd *hcd)
     bce_vhci_event_queue_resume(&vhci->ev_asynchronous);
     bce_vhci_event_queue_resume(&vhci->ev_commands);
 
-    pr_info("bce_vhci: resume controller\n");
     if ((status = bce_vhci_cmd_controller_start(&vhci->cq)))
         return status;
+    bce_vhci_port_status_invalidate_all(vhci);
+    t_controller = ktime_get();
 
-    pr_info("bce_vhci: resume ports\n");
-    for (i = 0; i < 16; i++) {
-        if (!vhci->port_to_device[i])
-            continue;
-        bce_vhci_cmd_port_resume(&vhci->cq, i);
+    bce_vhci_bus_port_command(vhci, BCE_VHCI_CMD_PORT_RESUME);
+    /* Resuming the ports changes their status again */
+    bce_vhci_port_status_invalidate_all(vhci);
+    t_ports = ktime_get();
+
+    bce_vhci_bus_pause_endpoints(vhci, false);
+
+    pr_info("bce_vhci: resume done (controller %lld us, ports %lld us, endpoints %lld us)\n",
+            ktime_us_delta(t_controller, start), ktime_us_delta(t_ports, t_controller),
+            ktime_us_delta(ktime_get(), t_ports));
+    return 0;
+}
+
+/* Only standard GET_DESCRIPTOR requests on the default pipe are cached */
+static struct usb_ctrlrequest *bce_vhci_desc_cache_request(struct urb *urb)
+{
+    struct usb_ctrlrequest *setup = (struct usb_ctrlrequest *) urb->setup_packet;
+    if (usb_endpoint_num(&urb->ep->desc) != 0 || !setup || !urb->transfer_buffer || urb->dev->portnum >= 16)
+        return NULL;
+    if (setup->bRequestType != (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) ||
+        setup->bRequest != USB_REQ_GET_DESCRIPTOR)
+        return NULL;
+    return setup;
+}
+
+static void bce_vhci_desc_cache_clear_entries(struct bce_vhci_desc_cache *c)
+{
+    int i;
+    for (i = 0; i < BCE_VHCI_DESC_CACHE_ENTRIES; i++) {
+        kfree(c->entries[i].data);
+        c->entries[i].data = NULL;
     }
-    pr_info("bce_vhci: resume endpoints\n");
-    for (i = 0; i < 16; i++) {
-        if (!vhci->port_to_device[i])
+}
+
+/* The device on the port may have changed; with forget set the port was disconnected, so drop everything */
+static void bce_vhci_desc_cache_invalidate(struct bce_vhci *vhci, bce_vhci_port_t port, bool forget)
+{
+    struct bce_vhci_desc_cache *c = &vhci->desc_cache[port];
+    unsigned long flags;
+    spin_lock_irqsave(&vhci->desc_cache_lock, flags);
+    c->verified = false;
+    if (forget) {
+        c->has_device = false;
+        bce_vhci_desc_cache_clear_entries(c);
+    }
+    spin_unlock_irqrestore(&vhci->desc_cache_lock, flags);
+}
+
+/* Called for every control URB the device completed successfully */
+void bce_vhci_desc_cache_update(struct bce_vhci *vhci, struct urb *urb)
+{
+    struct usb_ctrlrequest *setup = bce_vhci_desc_cache_request(urb);
+    struct bce_vhci_desc_cache *c;
+    struct bce_vhci_desc_cache_entry *e = NULL;
+    u16 wValue, wIndex;
+    unsigned long flags;
+    u8 *data;
+    int i;
+    if (!setup || urb->status || !urb->actual_length)
+        return;
+    /* With bounce buffers the data only reaches transfer_buffer once the URB is unmapped; usbcore won't unmap
+     * it a second time on giveback */
+    usb_hcd_unmap_urb_for_dma(vhci->hcd, urb);
+    wValue = le16_to_cpu(setup->wValue);
+    wIndex = le16_to_cpu(setup->wIndex);
+    c = &vhci->desc_cache[urb->dev->portnum];
+
+    /* The device descriptor identifies the device, so it is always read from the device itself */
+    if ((wValue >> 8) == USB_DT_DEVICE) {
+        if (urb->actual_length < USB_DT_DEVICE_SIZE)
+            return;
+        spin_lock_irqsave(&vhci->desc_cache_lock, flags);
+        if (!c->has_device || memcmp(&c->device, urb->transfer_buffer, USB_DT_DEVICE_SIZE)) {
+            bce_vhci_desc_cache_clear_entries(c);
+            memcpy(&c->device, urb->transfer_buffer, USB_DT_DEVICE_SIZE);
+            c->has_device = true;
+        }
+        c->verified = true;
+        spin_unlock_irqrestore(&vhci->desc_cache_lock, flags);
+        return;
+    }
+
+    data = kmemdup(urb->transfer_buffer, urb->actual_length, GFP_ATOMIC);
+    if (!data)
+        return;
+    spin_lock_irqsave(&vhci->desc_cache_lock, flags);
+    if (c->verified) {
+        for (i = 0; i < BCE_VHCI_DESC_CACHE_ENTRIES; i++) {
+            if (!c->entries[i].data) {
+                if (!e)
+                    e = &c->entries[i];
+            } else if (c->entries[i].wValue == wValue && c->entries[i].wIndex == wIndex) {
+                e = &c->entries[i];
+                break;
+            }
+        }
+    }
+    /* Keep the longest read of the descriptor, usbcore usually reads the header first */
+    if (e && (!e->data || urb->actual_length >= e->length)) {
+        swap(e->data, data);
+        e->wValue = wValue;
+        e->wIndex = wIndex;
+        e->length = (u16) urb->actual_length;
+        e->complete = urb->actual_length < urb->transfer_buffer_length;
+    }
+    spin_unlock_irqrestore(&vhci->desc_cache_lock, flags);
+    kfree(data);
+}
+
+/* Completes a GET_DESCRIPTOR request from the cache, returns -ENOENT if it has to go to the device */
+static int bce_vhci_desc_cache_complete(struct bce_vhci *vhci, struct bce_vhci_transfer_queue *q, struct urb *urb)
+{
+    struct usb_ctrlrequest *setup = bce_vhci_desc_cache_request(urb);
+    struct bce_vhci_desc_cache *c;
+    struct bce_vhci_desc_cache_entry *e;
+    u16 wValue, wIndex;
+    u32 len = 0;
+    unsigned long flags;
+    int i, status = -ENOENT;
+    if (!setup)
+        return -ENOENT;
+    wValue = le16_to_cpu(setup->wValue);
+    wIndex = le16_to_cpu(setup->wIndex);
+    if ((wValue >> 8) == USB_DT_DEVICE)
+        return -ENOENT;
+    c = &vhci->desc_cache[urb->dev->portnum];
+
+    /* URBs are linked to the endpoint under urb_lock, so this can't be reordered with the requests queued to the
+     * device; the URB is also unlinked again before anyone else can see it at the head of the list */
+    spin_lock_irqsave(&q->urb_lock, flags);
+    if (!list_empty(&urb->ep->urb_list))
+        goto unlock;
+    spin_lock(&vhci->desc_cache_lock);
+    for (i = 0; c->verified && i < BCE_VHCI_DESC_CACHE_ENTRIES; i++) {
+        e = &c->entries[i];
+        if (!e->data || e->wValue != wValue || e->wIndex != wIndex)
             continue;
-        for (j = 0; j < 32; j++) {
-            if (!(vhci->devices[vhci->port_to_device[i]]->tq_mask & BIT(j)))
-                continue;
-            bce_vhci_transfer_queue_resume(&vhci->devices[vhci->port_to_device[i]]->tq[j],
-                    BCE_VHCI_PAUSE_SUSPEND);
+        if (e->complete || urb->transfer_buffer_length <= e->length) {
+            if ((status = usb_hcd_link_urb_to_ep(vhci->hcd, urb)))
+                break;
+            /* Unmap first, so that a bounce buffer isn't copied over the data afterwards */
+            usb_hcd_unmap_urb_for_dma(vhci->hcd, urb);
+            len = min_t(u32, urb->transfer_buffer_length, e->length);
+            memcpy(urb->transfer_buffer, e->data, len);
+            urb->actual_length = len;
+            usb_hcd_unlink_urb_from_ep(vhci->hcd, urb);
         }
+        break;
     }
+    spin_unlock(&vhci->desc_cache_lock);
+unlock:
+    spin_unlock_irqrestore(&q->urb_lock, flags);
+    if (status)
+        return status;
 
-    pr_info("bce_vhci: resume done\n");
+    pr_debug("bce-vhci: Completed descriptor read %x:%x from cache (%u bytes)\n", wValue, wIndex, len);
+    usb_hcd_giveback_urb(vhci->hcd, urb, 0);
     return 0;
 }
 
 static int bce_vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
 {
     struct bce_vhci_transfer_queue *q = urb->ep->hcpriv;
-    pr_debug("bce_vhci_urb_enqueue %i:%x\n", q->dev_addr, urb->ep->desc.bEndpointAddress);
+    int status;
     if (!q)
         return -ENOENT;
-    return bce_vhci_urb_create(q, urb);
+    pr_debug("bce_vhci_urb_enqueue %i:%x\n", q->dev_addr, urb->ep->desc.bEndpointAddress);
+    if ((status = bce_vhci_desc_cache_complete(bce_vhci_from_hcd(hcd), q, urb)) != -ENOENT)
+        return status;
+    return bce_vhci_urb_create(q, urb, mem_flags);
 }
 
 static int bce_vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
@@ -436,6 +863,7 @@ static int bce_vhci_add_endpoint(struct usb_hcd *hcd, struct usb_device *udev, s
     struct bce_vhci *vhci = bce_vhci_from_hcd(hcd);
     bce_vhci_device_t devid = vhci->port_to_device[udev->portnum];
     struct bce_vhci_device *vdev = vhci->devices[devid];
+    struct bce_vhci_transfer_queue *q;
     pr_info("bce_vhci_add_endpoint %x/%x:%x\n", udev->portnum, devid, endp_index);
 
     if (udev->bus->root_hub == udev) /* The USB hub */
@@ -443,19 +871,33 @@ static int bce_vhci_add_endpoint(struct usb_hcd *hcd, struct usb_device *udev, s
     if (vdev == NULL)
         return -ENODEV;
     if (vdev->tq_mask & BIT(endp_index)) {
-        endp->hcpriv = &vdev->tq[endp_index];
+        endp->hcpriv = vdev->tq[endp_index];
         return 0;
     }
 
-    bce_vhci_create_transfer_queue(vhci, &vdev->tq[endp_index], endp, devid,
-            usb_endpoint_dir_in(&endp->desc) ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
-    endp->hcpriv = &vdev->tq[endp_index];
+    q = bce_vhci_create_transfer_queue(vhci, endp, devid,
+            usb_endpoint_dir_in(&endp->desc) ? DMA_FROM_DEVICE : DMA_TO_DEVICE, vdev->cq);
+    if (!q)
+        return -ENOMEM;
+    rcu_assign_pointer(vdev->tq[endp_index], q);
+    endp->hcpriv = q;
     vdev->tq_mask |= BIT(endp_index);
-
-    bce_vhci_cmd_endpoint_create(&vhci->cq, devid, &endp->desc);
+    vdev->tq_added_mask |= BIT(endp_index);
     return 0;
 }
 
+static void bce_vhci_remove_endpoint(struct bce_vhci *vhci, bce_vhci_device_t devid, u8 endp_index,
+        struct bce_vhci_transfer_queue *q)
+{
+    struct bce_vhci_device *vdev = vhci->devices[devid];
+    bce_vhci_transfer_queue_pause(q, BCE_VHCI_PAUSE_SHUTDOWN);
+    vdev->tq_mask &= ~BIT(endp_index);
+    vdev->tq_added_mask &= ~BIT(endp_index);
+    RCU_INIT_POINTER(vdev->tq[endp_index], NULL);
+    bce_vhci_quiesce_events(vhci);
+    bce_vhci_destroy_transfer_queue(vhci, q);
+}
+
 static int bce_vhci_drop_endpoint(struct usb_hcd *hcd, struct usb_device *udev, struct usb_host_endpoint *endp)
 {
     u8 endp_index = bce_vhci_endpoint_index(endp->desc.bEndpointAddress);
@@ -467,15 +909,13 @@ static int bce_vhci_drop_endpoint(struct usb_hcd *hcd, struct usb_device *udev,
     if (!q) {
         if (vdev && vdev->tq_mask & BIT(endp_index)) {
             pr_err("something deleted the hcpriv?\n");
-            q = &vdev->tq[endp_index];
+            q = vdev->tq[endp_index];
         } else {
             return 0;
         }
     }
 
-    bce_vhci_cmd_endpoint_destroy(&vhci->cq, devid, (u8) (endp->desc.bEndpointAddress & 0x8Fu));
-    vhci->devices[devid]->tq_mask &= ~BIT(endp_index);
-    bce_vhci_destroy_transfer_queue(vhci, q);
+    bce_vhci_remove_endpoint(vhci, devid, endp_index, q);
     return 0;
 }
 
@@ -489,7 +929,6 @@ static int bce_vhci_create_message_queues(struct bce_vhci *vhci)
         bce_vhci_destroy_message_queues(vhci);
         return -EINVAL;
     }
-    spin_lock_init(&vhci->msg_asynchronous_lock);
     bce_vhci_command_queue_create(&vhci->cq, &vhci->msg_commands);
     return 0;
 }
@@ -563,18 +1002,19 @@ static int bce_vhci_handle_firmware_event(struct bce_vhci *vhci, struct bce_vhci
     if (msg->cmd == BCE_VHCI_CMD_ENDPOINT_REQUEST_STATE || msg->cmd == BCE_VHCI_CMD_ENDPOINT_SET_STATE) {
         devid = (bce_vhci_device_t) (msg->param1 & 0xff);
         endp = bce_vhci_endpoint_index((u8) ((msg->param1 >> 8) & 0xff));
-        dev = vhci->devices[devid];
-        if (!dev || !(dev->tq_mask & BIT(endp)))
+        /* Whatever is unpublished is only freed once this work is done, see bce_vhci_quiesce_events */
+        dev = devid < ARRAY_SIZE(vhci->devices) ? READ_ONCE(vhci->devices[devid]) : NULL;
+        tq = dev ? READ_ONCE(dev->tq[endp]) : NULL;
+        if (!tq)
             return BCE_VHCI_BAD_ARGUMENT;
-        tq = &dev->tq[endp];
     }
 
     if (msg->cmd == BCE_VHCI_CMD_ENDPOINT_REQUEST_STATE) {
         if (msg->param2 == BCE_VHCI_ENDPOINT_ACTIVE) {
-            bce_vhci_transfer_queue_resume(tq, BCE_VHCI_PAUSE_FIRMWARE);
+            bce_vhci_transfer_queue_request_firmware_pause(tq, false);
             return BCE_VHCI_SUCCESS;
         } else if (msg->param2 == BCE_VHCI_ENDPOINT_PAUSED) {
-            bce_vhci_transfer_queue_pause(tq, BCE_VHCI_PAUSE_FIRMWARE);
+            bce_vhci_transfer_queue_request_firmware_pause(tq, true);
             return BCE_VHCI_SUCCESS;
         }
         return BCE_VHCI_BAD_ARGUMENT;
@@ -644,7 +1084,7 @@ static void bce_vhci_handle_firmware_events_w(struct work_struct *ws)
         bce_notify_submission_complete(sq);
         ++cnt;
     }
-    bce_vhci_event_queue_submit_pending(&vhci->ev_commands, cnt);
+    bce_vhci_event_queue_replenish(&vhci->ev_commands, cnt);
     if (atomic_read(&sq->available_commands) == sq->el_count - 1) {
         pr_debug("bce-vhci: complete\n");
         complete(&vhci->ev_commands.queue_empty_completion);
@@ -654,13 +1094,22 @@ static void bce_vhci_handle_firmware_events_w(struct work_struct *ws)
 static void bce_vhci_firmware_event_completion(struct bce_queue_sq *sq)
 {
     struct bce_vhci_event_queue *q = sq->userdata;
-    queue_work(q->vhci->tq_state_wq, &q->vhci->w_fw_events);
+    queue_work(q->vhci->fw_event_wq, &q->vhci->w_fw_events);
 }
 
 static void bce_vhci_handle_system_event(struct bce_vhci_event_queue *q, struct bce_vhci_message *msg)
 {
+    struct bce_vhci *vhci = q->vhci;
     if (msg->cmd & 0x8000) {
-        bce_vhci_command_queue_deliver_completion(&q->vhci->cq, msg);
+        bce_vhci_command_queue_deliver_completion(&vhci->cq, msg);
+    } else if (msg->cmd == BCE_VHCI_CMD_PORT_STATUS && msg->param1 < 16) {
+        /* The firmware notifies us of port changes, so the hub code never needs to poll it */
+        pr_debug("bce-vhci: Port %i status changed to %llx\n", msg->param1, msg->param2);
+        if (msg->param2 & BCE_VHCI_PORT_STATUS_C_CONNECTION)
+            bce_vhci_desc_cache_invalidate(vhci, (bce_vhci_port_t) msg->param1, true);
+        bce_vhci_port_status_set(vhci, (bce_vhci_port_t) msg->param1, (u32) msg->param2);
+        if (vhci->hcd)
+            usb_hcd_poll_rh_status(vhci->hcd);
     } else {
         pr_warn("bce-vhci: Unhandled system event: %x s=%x p1=%x p2=%llx\n",
                 msg->cmd, msg->status, msg->param1, msg->param2);
@@ -672,17 +1121,21 @@ static void bce_vhci_handle_usb_event(struct bce_vhci_event_queue *q, struct bce
     bce_vhci_device_t devid;
     u8 endp;
     struct bce_vhci_device *dev;
+    struct bce_vhci_transfer_queue *tq = NULL;
     if (msg->cmd & 0x8000) {
         bce_vhci_command_queue_deliver_completion(&q->vhci->cq, msg);
     } else if (msg->cmd == BCE_VHCI_CMD_TRANSFER_REQUEST || msg->cmd == BCE_VHCI_CMD_CONTROL_TRANSFER_STATUS) {
         devid = (bce_vhci_device_t) (msg->param1 & 0xff);
         endp = bce_vhci_endpoint_index((u8) ((msg->param1 >> 8) & 0xff));
-        dev = q->vhci->devices[devid];
-        if (!dev || (dev->tq_mask & BIT(endp)) == 0) {
+        rcu_read_lock();
+        dev = devid < ARRAY_SIZE(q->vhci->devices) ? rcu_dereference(q->vhci->devices[devid]) : NULL;
+        if (dev)
+            tq = rcu_dereference(dev->tq[endp]);
+        if (tq)
+            bce_vhci_transfer_queue_event(tq, msg);
+        rcu_read_unlock();
+        if (!tq)
             pr_err("bce-vhci: Didn't find destination for transfer queue event\n");
-            return;
-        }
-        bce_vhci_transfer_queue_event(&dev->tq[endp], msg);
     } else {
         pr_warn("bce-vhci: Unhandled USB event: %x s=%x p1=%x p2=%llx\n",
                 msg->cmd, msg->status, msg->param1, msg->param2);
@@ -696,7 +1149,8 @@ static const struct hc_driver bce_vhci_driver = {
         .product_desc = "BCE VHCI Host Controller",
         .hcd_priv_size = sizeof(struct bce_vhci *),
 
-        .flags = HCD_USB2 | HCD_DMA,
+        /* URBs are given back from the BCE interrupt handler, let usbcore run the completions from its BH */
+        .flags = HCD_USB2 | HCD_DMA | HCD_BH,
 
         .start = bce_vhci_start,
         .stop = bce_vhci_stop,
@@ -711,6 +1165,7 @@ static const struct hc_driver bce_vhci_driver = {
         .drop_endpoint = bce_vhci_drop_endpoint,
         .endpoint_reset = bce_vhci_endpoint_reset,
         .check_bandwidth = bce_vhci_check_bandwidth,
+        .reset_bandwidth = bce_vhci_reset_bandwidth,
         .get_frame_number = bce_vhci_get_frame_number,
         .bus_suspend = bce_vhci_bus_suspend,
         .bus_resume = bce_vhci_bus_resume
@@ -727,8 +1182,13 @@ int __init bce_vhci_module_init(void)
         result = PTR_ERR(bce_vhci_class);
         goto fail_class;
     }
+    bce_vhci_debugfs_dir = debugfs_create_dir("bce-vhci", NULL);
+    if ((result = bce_vhci_transfer_module_init(bce_vhci_debugfs_dir)))
+        goto fail_transfer;
     return 0;
 
+fail_transfer:
+    debugfs_remove_recursive(bce_vhci_debugfs_dir);
 fail_class:
     class_destroy(bce_vhci_class);
 fail_chrdev:
@@ -739,6 +1199,8 @@ fail_chrdev:
 }
 void __exit bce_vhci_module_exit(void)
 {
+    bce_vhci_transfer_module_exit();
+    debugfs_remove_recursive(bce_vhci_debugfs_dir);
     class_destroy(bce_vhci_class);
     unregister_chrdev_region(bce_vhci_chrdev, 1);
 }
@@ -1,16 +1,46 @@
 #ifndef BCE_VHCI_H
 #define BCE_VHCI_H
 
+#include <linux/ktime.h>
+#include <linux/usb/ch9.h>
 #include "queue.h"
 #include "transfer.h"
 
 struct usb_hcd;
 struct bce_queue_cq;
 
+/* Enough for every non-isochronous endpoint of a device to have all of its requests in flight */
+#define BCE_VHCI_DEVICE_CQ_EL_COUNT 0x100
+
 struct bce_vhci_device {
-    struct bce_vhci_transfer_queue tq[32];
+    /* Transfer queues are only allocated for the endpoints in use, tq_mask has a bit set for every one of them.
+     * They are published with rcu_assign_pointer for the event handlers, see bce_vhci_quiesce_events. */
+    struct bce_vhci_transfer_queue *tq[32];
     u32 tq_mask;
+    /* Endpoints added since the last successful check_bandwidth, whose ENDPOINT_CREATE may still be pending */
+    u32 tq_added_mask;
+    struct bce_queue_cq *cq;
+};
+/* Standard descriptors last read from the device on a port, used to answer usbcore's repeated reads during
+ * re-enumeration without going through the firmware. Entries are only served after the device descriptor was
+ * re-read from the device and found unchanged (verified). */
+#define BCE_VHCI_DESC_CACHE_ENTRIES 8
+
+struct bce_vhci_desc_cache_entry {
+    u16 wValue;
+    u16 wIndex;
+    u16 length;
+    /* The device returned less than requested, so the descriptor is complete */
+    bool complete;
+    u8 *data;
 };
+struct bce_vhci_desc_cache {
+    struct usb_device_descriptor device;
+    bool has_device;
+    bool verified;
+    struct bce_vhci_desc_cache_entry entries[BCE_VHCI_DESC_CACHE_ENTRIES];
+};
+
 struct bce_vhci {
     struct bce_device *dev;
     dev_t vdevt;
@@ -22,7 +52,6 @@ struct bce_vhci {
     struct bce_vhci_message_queue msg_isochronous;
     struct bce_vhci_message_queue msg_interrupt;
     struct bce_vhci_message_queue msg_asynchronous;
-    struct spinlock msg_asynchronous_lock;
     struct bce_vhci_command_queue cq;
     struct bce_queue_cq *ev_cq;
     struct bce_vhci_event_queue ev_commands;
@@ -33,10 +62,20 @@ struct bce_vhci {
     u16 port_mask;
     u8 port_count;
     u16 port_power_mask;
+    struct spinlock port_status_lock;
+    u16 port_status_valid;
+    u32 port_status[16];
+    /* Bumped on every update of a port status, so a query that raced with a newer one doesn't overwrite it */
+    u32 port_status_seq[16];
+    ktime_t frame_base;
     bce_vhci_device_t port_to_device[16];
     struct bce_vhci_device *devices[16];
+    struct spinlock desc_cache_lock;
+    struct bce_vhci_desc_cache desc_cache[16];
     struct workqueue_struct *tq_state_wq;
+    struct workqueue_struct *fw_event_wq;
     struct work_struct w_fw_events;
+    struct dentry *debugfs_dir;
 };
 
 int __init bce_vhci_module_init(void);
@@ -45,4 +84,6 @@ void __exit bce_vhci_module_exit(void);
 int bce_vhci_create(struct bce_device *dev, struct bce_vhci *vhci);
 void bce_vhci_destroy(struct bce_vhci *vhci);
 
+void bce_vhci_desc_cache_update(struct bce_vhci *vhci, struct urb *urb);
+
 #endif //BCE_VHCI_H